@@ -1,319 +1,351 @@
 #include "mesh.h"
-#include <unordered_set>
+#include <algorithm>
+#include <cassert>
 
-int degree(Vertex *v) {
-    Halfedge *start = v->halfedge;
-    Halfedge *h = start;
+int Mesh::degree(Idx v) const {
+    assert(int(_v_degree[v]) == countDegree(v));
+    return _v_degree[v];
+}
+
+int Mesh::countDegree(Idx v) const {
     int d = 0;
-    do {
-        d++;
-        h = h->twin->next;
-    }
-    while(h != start);
+    for([[maybe_unused]] Idx h : outgoing(v)) d++;
     return d;
 }
 
-bool Mesh::canCollapse(Halfedge *halfedge) {
-    Halfedge *twin = halfedge->twin;
-
-    std::unordered_set<Vertex*> hset;
-    std::unordered_set<Vertex*> tset;
-
-    Halfedge *h = halfedge;
-    do {
-        hset.insert(h->twin->vertex);
-        h = h->twin->next;
+// link condition: the endpoints may only share the two vertices opposite the edge,
+// checked without allocating by keeping one endpoint's neighbors on the stack
+bool Mesh::canCollapse(Idx halfedge) const {
+    Idx a = _he_vertex[halfedge];
+    Idx b = _he_vertex[_he_twin[halfedge]];
+
+    constexpr int max_buffered = 32;
+    Idx ring[max_buffered];
+    int n_ring = 0;
+    bool buffered = degree(a) <= max_buffered;
+    if(buffered) {
+        for(Idx h : outgoing(a)) ring[n_ring++] = _he_vertex[_he_twin[h]];
     }
-    while(h != halfedge);
 
-    h = twin;
-    do {
-        tset.insert(h->twin->vertex);
-        h = h->twin->next;
-    }
-    while(h != twin);
-
-    for(Vertex* v : hset) {
-        if(tset.contains(v) && degree(v) <= 3) return false;
+    auto isNeighborOfA = [&](Idx v) {
+        if(buffered) return std::find(ring, ring + n_ring, v) != ring + n_ring;
+        for(Idx h : outgoing(a)) {
+            if(_he_vertex[_he_twin[h]] == v) return true;
+        }
+        return false;
+    };
+
+    int shared = 0;
+    for(Idx h : outgoing(b)) {
+        Idx v = _he_vertex[_he_twin[h]];
+        if(!isNeighborOfA(v)) continue;
+        // check shared neighbor degrees too, they lose an edge
+        if(degree(v) <= 3 || ++shared > 2) return false;
     }
 
-    return true;
+    return shared == 2;
 }
 
-bool Mesh::edgeFlip(Halfedge *halfedge) {
-    Halfedge *twin = halfedge->twin;
+bool Mesh::edgeFlip(Idx halfedge) {
+    Idx twin = _he_twin[halfedge];
 
     // check endpoint degrees
-    if(degree(twin->vertex) <= 3 || degree(halfedge->vertex) <= 3) {
+    if(degree(_he_vertex[twin]) <= 3 || degree(_he_vertex[halfedge]) <= 3) {
         return false;
     }
 
     // reassign old vertex halfedges
-    Vertex *old_halfedge_vertex = halfedge->vertex;
-    Vertex *old_twin_vertex = twin->vertex;
+    Idx old_halfedge_vertex = _he_vertex[halfedge];
+    Idx old_twin_vertex = _he_vertex[twin];
 
-    if(old_halfedge_vertex->halfedge == halfedge) old_halfedge_vertex->halfedge = halfedge->next->next->twin;
+    if(_v_halfedge[old_halfedge_vertex] == halfedge) _v_halfedge[old_halfedge_vertex] = _he_twin[_he_next[_he_next[halfedge]]];
 
-    if(old_twin_vertex->halfedge == twin) old_twin_vertex->halfedge = twin->next->next->twin;
+    if(_v_halfedge[old_twin_vertex] == twin) _v_halfedge[old_twin_vertex] = _he_twin[_he_next[_he_next[twin]]];
+
+    // the flipped edge moves from its endpoints to the opposite vertices
+    _v_degree[old_halfedge_vertex]--;
+    _v_degree[old_twin_vertex]--;
+    _v_degree[_he_vertex[_he_next[_he_next[halfedge]]]]++;
+    _v_degree[_he_vertex[_he_next[_he_next[twin]]]]++;
 
     // build new triangles
-    Vertex *new_halfedge_vertex = twin->next->next->vertex;
-    Halfedge *new_halfedge_next = halfedge->next->next;
-    Vertex *new_twin_vertex = halfedge->next->next->vertex;
-    Halfedge *new_twin_next = twin->next->next;
+    Idx new_halfedge_vertex = _he_vertex[_he_next[_he_next[twin]]];
+    Idx new_halfedge_next = _he_next[_he_next[halfedge]];
+    Idx new_twin_vertex = _he_vertex[_he_next[_he_next[halfedge]]];
+    Idx new_twin_next = _he_next[_he_next[twin]];
 
-    Halfedge *new_halfedge_previous = twin->next;
-    Halfedge *new_twin_previous = halfedge->next;
+    Idx new_halfedge_previous = _he_next[twin];
+    Idx new_twin_previous = _he_next[halfedge];
 
-    halfedge->vertex = new_halfedge_vertex;
-    halfedge->next = new_halfedge_next;
+    _he_vertex[halfedge] = new_halfedge_vertex;
+    _he_next[halfedge] = new_halfedge_next;
 
-    twin->vertex = new_twin_vertex;
-    twin->next = new_twin_next;
+    _he_vertex[twin] = new_twin_vertex;
+    _he_next[twin] = new_twin_next;
 
-    new_halfedge_previous->next = halfedge;
-    new_twin_previous->next = twin;
+    _he_next[new_halfedge_previous] = halfedge;
+    _he_next[new_twin_previous] = twin;
 
-    new_halfedge_next->next = new_halfedge_previous;
-    new_twin_next->next = new_twin_previous;
+    _he_next[new_halfedge_next] = new_halfedge_previous;
+    _he_next[new_twin_next] = new_twin_previous;
 
-    new_halfedge_previous->face = halfedge->face;
-    new_twin_previous->face = twin->face;
+    _he_face[new_halfedge_previous] = _he_face[halfedge];
+    _he_face[new_twin_previous] = _he_face[twin];
 
-    halfedge->face->halfedge = halfedge;
-    twin->face->halfedge = twin;
+    _f_halfedge[_he_face[halfedge]] = halfedge;
+    _f_halfedge[_he_face[twin]] = twin;
 
     return true;
 }
 
-bool Mesh::edgeCollapse(Halfedge *halfedge) {
-    Halfedge *twin = halfedge->twin;
-
+bool Mesh::edgeCollapse(Idx halfedge) {
     // check shared neighbor degrees
     if(!canCollapse(halfedge)) {
         return false;
     }
 
+    collapse(halfedge, _free);
+    return true;
+}
+
+void Mesh::collapse(Idx halfedge, FreeLists &freed) {
+    Idx twin = _he_twin[halfedge];
+
+    // degrees: the kept vertex takes the deleted one's edges, minus the collapsed edge
+    // and the two merged away, and the opposite vertices each lose an edge
+    _v_degree[_he_vertex[halfedge]] += _v_degree[_he_vertex[twin]] - 4;
+    _v_degree[_he_vertex[_he_next[_he_next[halfedge]]]]--;
+    _v_degree[_he_vertex[_he_next[_he_next[twin]]]]--;
+
     // new vertex
-    Vertex *new_vertex = halfedge->vertex;
-    new_vertex->pos = (new_vertex->pos + twin->vertex->pos)/2;
-    if(new_vertex->halfedge == halfedge) new_vertex->halfedge = twin->next;
+    Idx new_vertex = _he_vertex[halfedge];
+    _v_pos[new_vertex] = (_v_pos[new_vertex] + _v_pos[_he_vertex[twin]])/2;
+    if(_v_halfedge[new_vertex] == halfedge) _v_halfedge[new_vertex] = _he_next[twin];
 
     // edges to delete
-    Halfedge *delete1 = halfedge->next;
-    Halfedge *delete2 = twin->next->next;
+    Idx delete1 = _he_next[halfedge];
+    Idx delete2 = _he_next[_he_next[twin]];
 
     // reassign vertices for edges that have their vertex deleted
-    Vertex *delete_vertex = twin->vertex;
-    Halfedge *start = twin;
-    Halfedge *h = start;
+    Idx delete_vertex = _he_vertex[twin];
+    Idx start = twin;
+    Idx h = start;
     do {
-        h->vertex = new_vertex;
-        h = h->twin->next;
+        _he_vertex[h] = new_vertex;
+        h = _he_next[_he_twin[h]];
     }
     while(h != start);
 
     // reassign edges for vertices that have an edge deleted
-    Vertex *v1 = halfedge->next->next->vertex;
-    Vertex *v2 = twin->next->next->vertex;
+    Idx v1 = _he_vertex[_he_next[_he_next[halfedge]]];
+    Idx v2 = _he_vertex[_he_next[_he_next[twin]]];
 
-    if(v1->halfedge == halfedge->next->twin) v1->halfedge = halfedge->next->next;
-    if(v2->halfedge == twin->next->next) v2->halfedge = twin->next->twin;
+    if(_v_halfedge[v1] == _he_twin[_he_next[halfedge]]) _v_halfedge[v1] = _he_next[_he_next[halfedge]];
+    if(_v_halfedge[v2] == _he_next[_he_next[twin]]) _v_halfedge[v2] = _he_twin[_he_next[twin]];
 
     // faces to delete
-    Face *faceDelete1 = halfedge->next->twin->face;
-    Face *faceDelete2 = twin->next->next->twin->face;
-
-    // build new face 1
-    Face *face1 = halfedge->face;
-    Halfedge *a1 = halfedge->next->next;
-    Halfedge *a2 = halfedge->next->twin->next;
-    Halfedge *a3 = a2->next;
-    a1->face = face1;
-    a2->face = face1;
-    a3->face = face1;
-    a1->next = a2;
-    a2->next = a3;
-    a3->next = a1;
-    face1->halfedge = a1;
-
-    // build new face 2
-    Face *face2 = twin->face;
-    Halfedge *b1 = twin->next;
-    Halfedge *b2 = twin->next->next->twin->next;
-    Halfedge *b3 = b2->next;
-    b1->face = face2;
-    b2->face = face2;
-    b3->face = face2;
-    b1->next = b2;
-    b2->next = b3;
-    b3->next = b1;
-    face2->halfedge = b1;
+    Idx faceDelete1 = _he_face[_he_twin[_he_next[halfedge]]];
+    Idx faceDelete2 = _he_face[_he_twin[_he_next[_he_next[twin]]]];
+
+    Idx face1 = _he_face[halfedge];
+    Idx face2 = _he_face[twin];
+
+    if(faceDelete1 == faceDelete2) {
+        // the deleted vertex only had 3 faces, which leave a single face behind:
+        // the kept sides of face 1 and face 2, and the far side of the third face
+        Idx a1 = _he_next[_he_next[halfedge]];
+        Idx a2 = _he_next[twin];
+        Idx a3 = _he_next[_he_next[_he_twin[delete1]]];
+        _he_face[a1] = face1;
+        _he_face[a2] = face1;
+        _he_face[a3] = face1;
+        _he_next[a1] = a2;
+        _he_next[a2] = a3;
+        _he_next[a3] = a1;
+        _f_halfedge[face1] = a1;
+
+        faceDelete2 = face2;
+    } else {
+        // build new face 1
+        Idx a1 = _he_next[_he_next[halfedge]];
+        Idx a2 = _he_next[_he_twin[_he_next[halfedge]]];
+        Idx a3 = _he_next[a2];
+        _he_face[a1] = face1;
+        _he_face[a2] = face1;
+        _he_face[a3] = face1;
+        _he_next[a1] = a2;
+        _he_next[a2] = a3;
+        _he_next[a3] = a1;
+        _f_halfedge[face1] = a1;
+
+        // build new face 2
+        Idx b1 = _he_next[twin];
+        Idx b2 = _he_next[_he_twin[_he_next[_he_next[twin]]]];
+        Idx b3 = _he_next[b2];
+        _he_face[b1] = face2;
+        _he_face[b2] = face2;
+        _he_face[b3] = face2;
+        _he_next[b1] = b2;
+        _he_next[b2] = b3;
+        _he_next[b3] = b1;
+        _f_halfedge[face2] = b1;
+    }
 
     // clearing memory
-    _halfedges.erase(delete1);
-    _halfedges.erase(delete1->twin);
-    _halfedges.erase(delete2);
-    _halfedges.erase(delete2->twin);
-    _halfedges.erase(halfedge);
-    _halfedges.erase(twin);
-
-    delete faceDelete1;
-    if(faceDelete2 != faceDelete1) delete faceDelete2;
-    delete delete_vertex;
-    delete delete1->edge;
-    delete delete1->twin;
+    Idx delete1_twin = _he_twin[delete1];
+    Idx delete2_twin = _he_twin[delete2];
+
+    deleteFace(faceDelete1, freed);
+    if(faceDelete2 != faceDelete1) deleteFace(faceDelete2, freed);
+    deleteVertex(delete_vertex, freed);
+    deleteEdge(_he_edge[delete1], freed);
     bool delete_delete2 = true;
-    if(delete1->twin == delete2) {
+    if(delete1_twin == delete2) {
         delete_delete2 = false;
     }
-    delete delete1;
     if(delete_delete2) {
-        delete delete2->edge;
-        delete delete2->twin;
-        delete delete2;
+        deleteEdge(_he_edge[delete2], freed);
+        deleteHalfedge(delete2_twin, freed);
+        deleteHalfedge(delete2, freed);
     }
-    delete halfedge->edge;
-    delete twin;
-    delete halfedge;
-
-    return true;
+    deleteHalfedge(delete1_twin, freed);
+    deleteHalfedge(delete1, freed);
+    deleteEdge(_he_edge[halfedge], freed);
+    deleteHalfedge(twin, freed);
+    deleteHalfedge(halfedge, freed);
 }
 
-Vertex *Mesh::edgeSplit(Halfedge *halfedge) {
-    Halfedge *twin = halfedge->twin;
+Idx Mesh::edgeSplit(Idx halfedge) {
+    Idx twin = _he_twin[halfedge];
 
     // new vertex
-    Vertex *new_vertex = new Vertex;
-    new_vertex->pos = (halfedge->vertex->pos + twin->vertex->pos)/2;
+    Idx new_vertex = newVertex((_v_pos[_he_vertex[halfedge]] + _v_pos[_he_vertex[twin]])/2);
 
-    Vertex *upVertex = twin->vertex;
-    Vertex *rightVertex = twin->next->next->vertex;
-    Vertex *bottomVertex = halfedge->vertex;
-    Vertex *leftVertex = halfedge->next->next->vertex;
+    Idx upVertex = _he_vertex[twin];
+    Idx rightVertex = _he_vertex[_he_next[_he_next[twin]]];
+    Idx bottomVertex = _he_vertex[halfedge];
+    Idx leftVertex = _he_vertex[_he_next[_he_next[halfedge]]];
 
-    Face *topLeftFace = new Face;
-    Face *topRightFace = new Face;
-    Face *bottomLeftFace = halfedge->face;
-    Face *bottomRightFace = twin->face;
+    Idx topLeftFace = newFace();
+    Idx topRightFace = newFace();
+    Idx bottomLeftFace = _he_face[halfedge];
+    Idx bottomRightFace = _he_face[twin];
 
-    Edge *upEdge = new Edge;
-    Halfedge *upHalfedge = new Halfedge;
-    Halfedge *upTwin = new Halfedge;
+    Idx upEdge = newEdge();
+    Idx upHalfedge = newHalfedge();
+    Idx upTwin = newHalfedge();
 
-    Edge *leftEdge = new Edge;
-    Halfedge *leftHalfedge = new Halfedge;
-    Halfedge *leftTwin = new Halfedge;
+    Idx leftEdge = newEdge();
+    Idx leftHalfedge = newHalfedge();
+    Idx leftTwin = newHalfedge();
 
-    Edge *rightEdge = new Edge;
-    Halfedge *rightHalfedge = new Halfedge;
-    Halfedge *rightTwin = new Halfedge;
+    Idx rightEdge = newEdge();
+    Idx rightHalfedge = newHalfedge();
+    Idx rightTwin = newHalfedge();
 
-    Edge *bottomEdge = twin->edge;
-    Halfedge *bottomHalfedge = twin;
-    Halfedge *bottomTwin = halfedge;
+    Idx bottomEdge = _he_edge[twin];
+    Idx bottomHalfedge = twin;
+    Idx bottomTwin = halfedge;
 
-    Halfedge *topLeft = halfedge->next;
-    Halfedge *bottomLeft = topLeft->next;
-    Halfedge *bottomRight = twin->next;
-    Halfedge *topRight = bottomRight->next;
+    Idx topLeft = _he_next[halfedge];
+    Idx bottomLeft = _he_next[topLeft];
+    Idx bottomRight = _he_next[twin];
+    Idx topRight = _he_next[bottomRight];
 
     // set up the new vertex
-    bottomHalfedge->vertex = new_vertex;
-    upHalfedge->vertex = new_vertex;
-    rightHalfedge->vertex = new_vertex;
-    leftHalfedge->vertex = new_vertex;
+    _he_vertex[bottomHalfedge] = new_vertex;
+    _he_vertex[upHalfedge] = new_vertex;
+    _he_vertex[rightHalfedge] = new_vertex;
+    _he_vertex[leftHalfedge] = new_vertex;
+
+    _v_halfedge[new_vertex] = upHalfedge;
 
-    new_vertex->halfedge = upHalfedge;
+    // the new vertex connects to all four, and the left and right vertices gain an edge
+    _v_degree[new_vertex] = 4;
+    _v_degree[leftVertex]++;
+    _v_degree[rightVertex]++;
 
     // set up the twins's vertices
-    bottomTwin->vertex = bottomVertex;
-    leftTwin->vertex = leftVertex;
-    upTwin->vertex = upVertex;
-    rightTwin->vertex = rightVertex;
+    _he_vertex[bottomTwin] = bottomVertex;
+    _he_vertex[leftTwin] = leftVertex;
+    _he_vertex[upTwin] = upVertex;
+    _he_vertex[rightTwin] = rightVertex;
+
+    // the up vertex may have been leaving along the split edge
+    if(_v_halfedge[upVertex] == twin) _v_halfedge[upVertex] = upTwin;
 
     // set up the faces
-    bottomHalfedge->face = bottomRightFace;
-    upHalfedge->face = topLeftFace;
-    rightHalfedge->face = topRightFace;
-    leftHalfedge->face = bottomLeftFace;
-
-    bottomTwin->face = bottomLeftFace;
-    upTwin->face = topRightFace;
-    rightTwin->face = bottomRightFace;
-    leftTwin->face = topLeftFace;
-
-    bottomLeftFace->halfedge = bottomTwin;
-    bottomRightFace->halfedge = bottomHalfedge;
-    topLeftFace->halfedge = upHalfedge;
-    topRightFace->halfedge = upTwin;
-
-    topLeft->face = topLeftFace;
-    topRight->face = topRightFace;
-    bottomLeft->face = bottomLeftFace;
-    bottomRight->face = bottomRightFace;
+    _he_face[bottomHalfedge] = bottomRightFace;
+    _he_face[upHalfedge] = topLeftFace;
+    _he_face[rightHalfedge] = topRightFace;
+    _he_face[leftHalfedge] = bottomLeftFace;
+
+    _he_face[bottomTwin] = bottomLeftFace;
+    _he_face[upTwin] = topRightFace;
+    _he_face[rightTwin] = bottomRightFace;
+    _he_face[leftTwin] = topLeftFace;
+
+    _f_halfedge[bottomLeftFace] = bottomTwin;
+    _f_halfedge[bottomRightFace] = bottomHalfedge;
+    _f_halfedge[topLeftFace] = upHalfedge;
+    _f_halfedge[topRightFace] = upTwin;
+
+    _he_face[topLeft] = topLeftFace;
+    _he_face[topRight] = topRightFace;
+    _he_face[bottomLeft] = bottomLeftFace;
+    _he_face[bottomRight] = bottomRightFace;
 
     // set up the edges
-    leftHalfedge->edge = leftEdge;
-    leftTwin->edge = leftEdge;
-    leftEdge->halfedge=leftHalfedge;
+    _he_edge[leftHalfedge] = leftEdge;
+    _he_edge[leftTwin] = leftEdge;
+    _e_halfedge[leftEdge] = leftHalfedge;
 
-    rightHalfedge->edge = rightEdge;
-    rightTwin->edge = rightEdge;
-    rightEdge->halfedge=rightHalfedge;
+    _he_edge[rightHalfedge] = rightEdge;
+    _he_edge[rightTwin] = rightEdge;
+    _e_halfedge[rightEdge] = rightHalfedge;
 
-    upHalfedge->edge = upEdge;
-    upTwin->edge = upEdge;
-    upEdge->halfedge=upHalfedge;
+    _he_edge[upHalfedge] = upEdge;
+    _he_edge[upTwin] = upEdge;
+    _e_halfedge[upEdge] = upHalfedge;
 
-    bottomHalfedge->edge = bottomEdge;
-    bottomTwin->edge = bottomEdge;
-    bottomEdge->halfedge=bottomHalfedge;
+    _he_edge[bottomHalfedge] = bottomEdge;
+    _he_edge[bottomTwin] = bottomEdge;
+    _e_halfedge[bottomEdge] = bottomHalfedge;
 
     // set up twins
-    leftHalfedge->twin = leftTwin;
-    leftTwin->twin = leftHalfedge;
+    _he_twin[leftHalfedge] = leftTwin;
+    _he_twin[leftTwin] = leftHalfedge;
 
-    rightHalfedge->twin = rightTwin;
-    rightTwin->twin = rightHalfedge;
+    _he_twin[rightHalfedge] = rightTwin;
+    _he_twin[rightTwin] = rightHalfedge;
 
-    upHalfedge->twin = upTwin;
-    upTwin->twin = upHalfedge;
+    _he_twin[upHalfedge] = upTwin;
+    _he_twin[upTwin] = upHalfedge;
 
-    bottomHalfedge->twin = bottomTwin;
-    bottomTwin->twin = bottomHalfedge;
+    _he_twin[bottomHalfedge] = bottomTwin;
+    _he_twin[bottomTwin] = bottomHalfedge;
 
     // set up "next"
-    leftHalfedge->next = bottomLeft;
-    bottomLeft->next = bottomTwin;
-    bottomTwin->next = leftHalfedge;
-
-    leftTwin->next = upHalfedge;
-    upHalfedge->next = topLeft;
-    topLeft->next = leftTwin;
-
-    rightHalfedge->next = topRight;
-    topRight->next = upTwin;
-    upTwin->next = rightHalfedge;
-
-    rightTwin->next = bottomHalfedge;
-    bottomHalfedge->next = bottomRight;
-    bottomRight->next = rightTwin;
-
-    // add new halfedges to mesh
-    _halfedges[leftHalfedge] = leftHalfedge;
-    _halfedges[leftTwin] = leftTwin;
-
-    _halfedges[rightHalfedge] = rightHalfedge;
-    _halfedges[rightTwin] = rightTwin;
-
-    _halfedges[upHalfedge] = upHalfedge;
-    _halfedges[upTwin] = upTwin;
-
-    upEdge->is_new = false;
-    bottomEdge->is_new = false;
-    leftEdge->is_new = true;
-    rightEdge->is_new = true;
+    _he_next[leftHalfedge] = bottomLeft;
+    _he_next[bottomLeft] = bottomTwin;
+    _he_next[bottomTwin] = leftHalfedge;
+
+    _he_next[leftTwin] = upHalfedge;
+    _he_next[upHalfedge] = topLeft;
+    _he_next[topLeft] = leftTwin;
+
+    _he_next[rightHalfedge] = topRight;
+    _he_next[topRight] = upTwin;
+    _he_next[upTwin] = rightHalfedge;
+
+    _he_next[rightTwin] = bottomHalfedge;
+    _he_next[bottomHalfedge] = bottomRight;
+    _he_next[bottomRight] = rightTwin;
+
+    _e_is_new[upEdge] = false;
+    _e_is_new[bottomEdge] = false;
+    _e_is_new[leftEdge] = true;
+    _e_is_new[rightEdge] = true;
 
     return new_vertex;
 }
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+
+#include "properties.h"
+
+// binary min-heap of keys (e.g. edge indices) by priority, which also tracks where each key sits
+// so that a key's priority can be changed or the key removed in place
+class IndexedHeap
+{
+public:
+    static constexpr Idx NOT_QUEUED = std::numeric_limits<Idx>::max();
+
+    // keys are in [0, n_keys)
+    explicit IndexedHeap(Idx n_keys) : _slot(n_keys, NOT_QUEUED) {}
+
+    bool empty() const {return _heap.empty();}
+    Idx size() const {return _heap.size();}
+
+    bool contains(Idx key) const {return _slot[key] != NOT_QUEUED;}
+
+    Idx top() const {return _heap[0].key;}
+    float topPriority() const {return _heap[0].priority;}
+
+    // queue the keys without ordering them, then order them all at once with heapify()
+    void reserve(Idx n) {_heap.reserve(n);}
+    void append(Idx key, float priority) {
+        assert(!contains(key));
+        _slot[key] = _heap.size();
+        _heap.push_back({priority, key});
+    }
+
+    // O(n), bottom-up
+    void heapify() {
+        for(Idx i = _heap.size()/2; i-- > 0;) siftDown(i);
+    }
+
+    void pop() {remove(top());}
+
+    // queues the key if it isn't already
+    void update(Idx key, float priority) {
+        if(!contains(key)) {
+            append(key, priority);
+            siftUp(_heap.size()-1);
+        } else {
+            Idx i = _slot[key];
+            float old_priority = _heap[i].priority;
+            _heap[i].priority = priority;
+            if(priority < old_priority) siftUp(i);
+            else siftDown(i);
+        }
+    }
+
+    // does nothing if the key isn't queued
+    void remove(Idx key) {
+        if(!contains(key)) return;
+        Idx i = _slot[key];
+        _slot[key] = NOT_QUEUED;
+
+        Entry last = _heap.back();
+        _heap.pop_back();
+        if(i == _heap.size()) return;
+
+        // the last entry fills the hole, and can go either way from there
+        float old_priority = _heap[i].priority;
+        place(i, last);
+        if(last.priority < old_priority) siftUp(i);
+        else siftDown(i);
+    }
+
+private:
+    struct Entry
+    {
+        float priority;
+        Idx key;
+    };
+
+    std::vector<Entry> _heap;
+    std::vector<Idx> _slot; // position of each key in _heap
+
+    void place(Idx i, const Entry &entry) {
+        _heap[i] = entry;
+        _slot[entry.key] = i;
+    }
+
+    void siftUp(Idx i) {
+        Entry entry = _heap[i];
+        while(i > 0) {
+            Idx parent = (i-1)/2;
+            if(!(entry.priority < _heap[parent].priority)) break;
+            place(i, _heap[parent]);
+            i = parent;
+        }
+        place(i, entry);
+    }
+
+    void siftDown(Idx i) {
+        Entry entry = _heap[i];
+        Idx n = _heap.size();
+        while(true) {
+            Idx child = 2*i+1;
+            if(child >= n) break;
+            if(child+1 < n && _heap[child+1].priority < _heap[child].priority) child++;
+            if(!(_heap[child].priority < entry.priority)) break;
+            place(i, _heap[child]);
+            i = child;
+        }
+        place(i, entry);
+    }
+};
@@ -0,0 +1,100 @@
+#include "loop_stencils.h"
+
+#include <cassert>
+
+using namespace Eigen;
+using namespace std;
+
+typedef SparseMatrix<float, RowMajor> Stencils;
+
+// the deleted slots are left out, keeping the others' order like exportHalfedges does
+void LoopStencils::start(const Mesh &mesh) {
+    vector<Triplet<float>> entries;
+    entries.reserve(mesh.numVertices());
+    for(Idx v : mesh.vertices()) {
+        entries.emplace_back(entries.size(), v, 1.f);
+    }
+    _weights = Stencils(mesh.numVertices(), mesh.numVertexSlots());
+    _weights.setFromTriplets(entries.begin(), entries.end());
+    _faces.clear();
+}
+
+// the same rules as loopSubdivide, with rows numbered the same way: old vertex v keeps its index and
+// edge e's new vertex is V+e
+void LoopStencils::refine(const Mesh &mesh) {
+    assert(mesh.numVertices() == mesh.numVertexSlots() && mesh.numEdges() == mesh.numEdgeSlots());
+    assert(Idx(_weights.rows()) == mesh.numVertices());
+    const Idx n_vertices = mesh.numVertexSlots();
+    const Idx n_edges = mesh.numEdgeSlots();
+
+    // each row's entries start after those of the rows before it
+    vector<Idx> row_start(n_vertices + 1);
+    row_start[0] = 0;
+    for(Idx v = 0; v < n_vertices; v++) {
+        row_start[v+1] = row_start[v] + mesh.degree(v) + 1;
+    }
+    const Idx edge_start = row_start[n_vertices];
+    vector<Triplet<float>> entries(edge_start + 4*n_edges);
+
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        int n = mesh.degree(v);
+        float u = vertex_weight(n);
+        Idx i = row_start[v];
+        for(Idx h : mesh.outgoing(v)) {
+            entries[i++] = Triplet<float>(v, mesh.vertex(mesh.twin(h)), u);
+        }
+        entries[i] = Triplet<float>(v, v, 1-n*u);
+    }
+    #pragma omp parallel for
+    for(Idx e = 0; e < n_edges; e++) {
+        Idx h = mesh.edgeHalfedge(e);
+        Idx t = mesh.twin(h);
+        Idx row = n_vertices + e;
+        Idx i = edge_start + 4*e;
+        entries[i] = Triplet<float>(row, mesh.vertex(h), 3/8.f);
+        entries[i+1] = Triplet<float>(row, mesh.vertex(t), 3/8.f);
+        entries[i+2] = Triplet<float>(row, mesh.vertex(mesh.next(mesh.next(h))), 1/8.f);
+        entries[i+3] = Triplet<float>(row, mesh.vertex(mesh.next(mesh.next(t))), 1/8.f);
+    }
+
+    Stencils level(n_vertices + n_edges, n_vertices);
+    level.setFromTriplets(entries.begin(), entries.end());
+
+    // composing with the levels so far keeps the table in terms of the control vertices
+    Stencils composed = level * _weights;
+    _weights.swap(composed);
+}
+
+void LoopStencils::finish(const Mesh &mesh) {
+    _weights.makeCompressed();
+    _faces.clear();
+    _faces.reserve(mesh.numFaces());
+    for(Idx f : mesh.faces()) {
+        Idx h = mesh.faceHalfedge(f);
+        _faces.emplace_back(mesh.vertex(h), mesh.vertex(mesh.next(h)), mesh.vertex(mesh.next(mesh.next(h))));
+    }
+}
+
+void LoopStencils::apply(const Vector3f *control, Vector3f *refined) const {
+    const int *row_start = _weights.outerIndexPtr();
+    const int *column = _weights.innerIndexPtr();
+    const float *weight = _weights.valuePtr();
+    const Idx n_rows = _weights.rows();
+
+    // every refined vertex is a short weighted sum of control vertices, independent of the others
+    #pragma omp parallel for
+    for(Idx r = 0; r < n_rows; r++) {
+        Vector3f sum = Vector3f::Zero();
+        for(int i = row_start[r]; i < row_start[r+1]; i++) {
+            sum += weight[i]*control[column[i]];
+        }
+        refined[r] = sum;
+    }
+}
+
+void LoopStencils::apply(const vector<Vector3f> &control, vector<Vector3f> &refined) const {
+    assert(control.size() >= numControlVertices());
+    refined.resize(numRefinedVertices());
+    apply(control.data(), refined.data());
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include "Eigen/Sparse"
+
+#include "mesh.h"
+
+// the weight of each neighbor in Loop's rule for an old vertex of degree n
+float vertex_weight(int n);
+
+// n levels of Loop subdivision of a mesh's connectivity, recorded as one sparse matrix from its vertices
+// to the refined vertices. new positions on the same connectivity (e.g. each frame of an animated control
+// cage) are then refined by a matrix-vector product, without subdividing again
+class LoopStencils
+{
+public:
+    // called by loopSubdivision: before the first level, before each level on a mesh without deleted slots,
+    // and once it is done
+    void start(const Mesh &mesh);
+    void refine(const Mesh &mesh);
+    void finish(const Mesh &mesh);
+
+    // control vertices are numbered by their slot in the mesh given to start()
+    Idx numControlVertices() const {return _weights.cols();}
+    Idx numRefinedVertices() const {return _weights.rows();}
+    Idx numWeights() const {return _weights.nonZeros();}
+
+    // writes numRefinedVertices() positions into refined, allocating nothing
+    void apply(const Eigen::Vector3f *control, Eigen::Vector3f *refined) const;
+    void apply(const std::vector<Eigen::Vector3f> &control, std::vector<Eigen::Vector3f> &refined) const;
+
+    // the refined mesh's faces, by refined vertex
+    const std::vector<Eigen::Vector3i> &faces() const {return _faces;}
+
+private:
+    // one row per refined vertex, in compressed (CSR) form
+    Eigen::SparseMatrix<float, Eigen::RowMajor> _weights;
+    std::vector<Eigen::Vector3i> _faces;
+};
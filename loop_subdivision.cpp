@@ -1,4 +1,5 @@
 #include "mesh.h"
+#include "loop_stencils.h"
 
 float vertex_weight(int n) {
     if (n == 3) return 3/16.f;
@@ -8,80 +9,297 @@ float vertex_weight(int n) {
     return (1.f/n)*w;
 }
 
+// the 1-to-4 refinement is fixed, so the refined mesh is written straight into new arrays: old vertex v
+// keeps its index and edge e's new vertex is V+e; old halfedge h becomes halves 2h (from vertex(h)) and
+// 2h+1 (to the end of h); face f becomes the corner faces 4f+i and the middle face 4f+3, whose three
+// inner edges have halfedges 2H+6f+i (in corner face i) and 2H+6f+3+i (in the middle face)
+// expects edges, faces and halfedges without deleted slots, which the index arithmetic relies on;
+// a deleted vertex slot stays deleted
 void Mesh::loopSubdivide() {
-    // build list of all the current edges
-    // build list of all the current vertices
-    // for each current vertex, store positions of adjacent ones
-    // for each edge, store the surrounding 4 vertices's positions
-    std::unordered_map<Vertex*, std::vector<Eigen::Vector3f>> old_vertices;
-    std::unordered_map<Edge*, std::vector<Eigen::Vector3f>> old_edges;
-    std::unordered_map<Vertex*, std::vector<Eigen::Vector3f>> new_vertices;
-
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-
-        if(!old_vertices.contains(h->vertex)) {
-            Vertex *v = h->vertex;
-            Halfedge *start = h;
-            do {
-                old_vertices[v].push_back(h->twin->vertex->pos);
-                h = h->twin->next;
-            }
-            while(h != start);
-        }
+    const Idx n_vertices = numVertexSlots();
+    const Idx n_edges = numEdgeSlots();
+    const Idx n_faces = numFaceSlots();
+    const Idx n_halfedges = numHalfedgeSlots();
+
+    // every new position from the current mesh, which is only read:
+    // old vertices move by their one-ring, and each edge's new vertex comes from the 4 surrounding ones.
+    // every loop below writes only the slots its own element owns, so they split across threads and
+    // give the same result for any thread count
+    std::vector<Eigen::Vector3f> v_pos(n_vertices + n_edges);
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        if(vertexDeleted(v)) continue;
+        int n = degree(v);
+        float u = vertex_weight(n);
 
-        if(!old_edges.contains(h->edge)) {
-            old_edges[h->edge].push_back(h->vertex->pos);
-            old_edges[h->edge].push_back(h->twin->vertex->pos);
-            old_edges[h->edge].push_back(h->next->next->vertex->pos);
-            old_edges[h->edge].push_back(h->twin->next->next->vertex->pos);
+        Eigen::Vector3f new_pos = Eigen::Vector3f(0,0,0);
+        for(Idx h : outgoing(v)) {
+            new_pos += u*position(vertex(twin(h)));
         }
+        new_pos += (1-n*u)*position(v);
+        v_pos[v] = new_pos;
+    }
+    #pragma omp parallel for
+    for(Idx e = 0; e < n_edges; e++) {
+        Idx h = edgeHalfedge(e);
+        v_pos[n_vertices + e] = (3/8.f)*(position(vertex(h)) + position(vertex(twin(h)))) + (1/8.f)*(position(vertex(next(next(h)))) + position(vertex(next(next(twin(h))))));
+    }
+
+    const Idx inner_halfedges = 2*n_halfedges;
+    const Idx inner_edges = 2*n_edges;
+    std::vector<Idx> he_next(2*n_halfedges + 6*n_faces);
+    std::vector<Idx> he_twin(he_next.size());
+    std::vector<Idx> he_vertex(he_next.size());
+    std::vector<Idx> he_edge(he_next.size());
+    std::vector<Idx> he_face(he_next.size());
+    std::vector<Idx> v_halfedge(n_vertices + n_edges);
+    std::vector<Idx> v_degree(n_vertices + n_edges);
+    std::vector<Idx> e_halfedge(2*n_edges + 3*n_faces);
+    std::vector<Idx> f_halfedge(4*n_faces);
+
+    // old vertices keep their degree, new ones sit inside and have 6 neighbors
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        v_halfedge[v] = vertexDeleted(v) ? INVALID : 2*vertexHalfedge(v);
+        v_degree[v] = _v_degree[v];
+    }
+    #pragma omp parallel for
+    for(Idx e = 0; e < n_edges; e++) {
+        Idx h = edgeHalfedge(e);
+        v_halfedge[n_vertices + e] = 2*h+1;
+        v_degree[n_vertices + e] = 6;
+        e_halfedge[2*e] = 2*h;
+        e_halfedge[2*e+1] = 2*h+1;
     }
 
-    // for each edge, split and save a list of new vertices with their 4 surrounding positions
-    for(auto &pair : old_edges) {
-        Edge *e = pair.first;
-        Vertex *new_v = edgeSplit(e->halfedge);
-        new_vertices[new_v] = pair.second;
+    // the halves of an edge: the first half of h lies along the second half of its twin
+    #pragma omp parallel for
+    for(Idx h = 0; h < n_halfedges; h++) {
+        Idx t = twin(h);
+        Idx e = edge(h);
+        bool first = edgeHalfedge(e) == h;
+        he_twin[2*h] = 2*t+1;
+        he_twin[2*h+1] = 2*t;
+        he_vertex[2*h] = vertex(h);
+        he_vertex[2*h+1] = n_vertices + e;
+        he_edge[2*h] = first ? 2*e : 2*e+1;
+        he_edge[2*h+1] = first ? 2*e+1 : 2*e;
     }
 
-    // flip new edges that touch a new and old vertex
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        Idx h[3];
+        h[0] = faceHalfedge(f);
+        h[1] = next(h[0]);
+        h[2] = next(h[1]);
+        for(Idx i = 0; i < 3; i++) {
+            Idx prev = (i+2)%3;
+            Idx corner = inner_halfedges + 6*f + i; // from the new vertex on h[i] to the one on h[prev]
+            Idx middle = inner_halfedges + 6*f + 3 + i; // its twin, the other way
+
+            // corner face i: vertex i, the new vertex on h[i], the new vertex on h[prev]
+            Idx a = 2*h[i];
+            Idx c = 2*h[prev]+1;
+            he_next[a] = corner;
+            he_next[corner] = c;
+            he_next[c] = a;
+            he_face[a] = he_face[corner] = he_face[c] = 4*f + i;
+            f_halfedge[4*f + i] = a;
+
+            he_vertex[corner] = n_vertices + edge(h[i]);
+            he_vertex[middle] = n_vertices + edge(h[prev]);
+            he_twin[corner] = middle;
+            he_twin[middle] = corner;
+            he_edge[corner] = he_edge[middle] = inner_edges + 3*f + i;
+            e_halfedge[inner_edges + 3*f + i] = corner;
 
-        if(h->edge->is_new) {
-            if((new_vertices.contains(h->vertex) && old_vertices.contains(h->twin->vertex)) || (new_vertices.contains(h->twin->vertex) && old_vertices.contains(h->vertex))) {
-                h->edge->is_new = false;
-                edgeFlip(h);
-            }
+            he_next[middle] = inner_halfedges + 6*f + 3 + (i+1)%3;
+            he_face[middle] = 4*f + 3;
         }
+        f_halfedge[4*f + 3] = inner_halfedges + 6*f + 3;
     }
 
-    // now, loop each current and new vertex and update positions
-    for(auto &pair : new_vertices) {
-        Vertex *v = pair.first;
-        std::vector<Eigen::Vector3f> surrounding = pair.second;
+    _he_next.swap(he_next);
+    _he_twin.swap(he_twin);
+    _he_vertex.swap(he_vertex);
+    _he_edge.swap(he_edge);
+    _he_face.swap(he_face);
+    _v_halfedge.swap(v_halfedge);
+    _v_pos.swap(v_pos);
+    _v_degree.swap(v_degree);
+    _e_halfedge.swap(e_halfedge);
+    _e_is_new.assign(_e_halfedge.size(), false);
+    _f_halfedge.swap(f_halfedge);
+
+    _vertex_props.resize(numVertexSlots());
+    _edge_props.resize(numEdgeSlots());
+    _face_props.resize(numFaceSlots());
+    _halfedge_props.resize(numHalfedgeSlots());
+}
+
+// where repeated subdivision takes a vertex: its limit mask weighs the one-ring like vertex_weight does,
+// with 3/(8u) in place of 1/u - n for the vertex itself
+Eigen::Vector3f Mesh::loopLimitPosition(Idx v) const {
+    int n = degree(v);
+    float w = 3/(8*vertex_weight(n));
 
-        v->pos = (3/8.f)*(surrounding[0] + surrounding[1]) + (1/8.f)*(surrounding[2]+surrounding[3]);
+    Eigen::Vector3f sum = w*position(v);
+    for(Idx h : outgoing(v)) {
+        sum += position(vertex(twin(h)));
     }
+    return sum / (w + n);
+}
 
-    for(auto &pair : old_vertices) {
-        Vertex *v = pair.first;
-        std::vector<Eigen::Vector3f> surrounding = pair.second;
-        int n = surrounding.size();
-        float u = vertex_weight(n);
+// the limit surface's tangents are the one-ring weighted by cos and sin of each neighbor's angle around v
+Eigen::Vector3f Mesh::loopLimitNormal(Idx v) const {
+    int n = degree(v);
+    Eigen::Vector3f t1(0,0,0);
+    Eigen::Vector3f t2(0,0,0);
+    int i = 0;
+    for(Idx h : outgoing(v)) {
+        float angle = 2.f*std::numbers::pi*i/n;
+        t1 += std::cos(angle)*position(vertex(twin(h)));
+        t2 += std::sin(angle)*position(vertex(twin(h)));
+        i++;
+    }
+    return t2.cross(t1).normalized();
+}
+
+void Mesh::loopLimitProjection() {
+    // every limit position comes from the current ones, so they are all found before any is moved
+    std::vector<Eigen::Vector3f> v_pos(numVertexSlots());
+    #pragma omp parallel for
+    for(Idx v = 0; v < numVertexSlots(); v++) {
+        if(!vertexDeleted(v)) v_pos[v] = loopLimitPosition(v);
+    }
+    _v_pos.swap(v_pos);
+}
+
+void Mesh::loopSubdivision(int n, LoopStencils *record) {
+    if(record) record->start(*this);
+
+    compact();
+
+    for(int i = 0; i < n; i++) {
+        if(record) record->refine(*this);
+        loopSubdivide();
+    }
 
+    if(record) record->finish(*this);
+}
+
+// one level of refinement where it's needed; false if no edge was
+bool Mesh::adaptiveLoopSubdivide(float tolerance) {
+    const Idx n_vertices = numVertexSlots();
+    const Idx n_edges = numEdgeSlots();
+
+    // an edge needs splitting where its new vertex would sit further than the tolerance off the edge itself
+    std::vector<Eigen::Vector3f> edge_pos(n_edges);
+    std::vector<std::uint8_t> split(n_edges, false);
+    #pragma omp parallel for
+    for(Idx e = 0; e < n_edges; e++) {
+        if(edgeDeleted(e)) continue;
+        Idx h = edgeHalfedge(e);
+        Eigen::Vector3f a = position(vertex(h));
+        Eigen::Vector3f b = position(vertex(twin(h)));
+        edge_pos[e] = (3/8.f)*(a + b) + (1/8.f)*(position(vertex(next(next(h)))) + position(vertex(next(next(twin(h))))));
+        split[e] = (edge_pos[e] - (a + b)/2).norm() > tolerance;
+    }
+
+    // red-green closure: a face with two split edges gets its third split too, until every face is left
+    // whole, bisected across its one split edge (green) or split 1-to-4 (red)
+    auto numSplit = [&](Idx f) {
+        Idx h = faceHalfedge(f);
+        return split[edge(h)] + split[edge(next(h))] + split[edge(next(next(h)))];
+    };
+    std::vector<Idx> queue;
+    for(Idx f : faces()) {
+        if(numSplit(f) == 2) queue.push_back(f);
+    }
+    while(!queue.empty()) {
+        Idx f = queue.back();
+        queue.pop_back();
+        if(numSplit(f) != 2) continue;
+
+        Idx h = faceHalfedge(f);
+        while(split[edge(h)]) h = next(h);
+        split[edge(h)] = true;
+        if(numSplit(face(twin(h))) == 2) queue.push_back(face(twin(h)));
+    }
+
+    std::vector<Idx> split_edges;
+    for(Idx e : edges()) {
+        if(split[e]) split_edges.push_back(e);
+    }
+    if(split_edges.empty()) return false;
+
+    Property<std::uint8_t> green = addFaceProperty<std::uint8_t>("loop:green", false);
+    for(Idx f : faces()) {
+        green[f] = numSplit(f) == 1;
+    }
+
+    // old vertices follow Loop's rule only where every edge around them is split, so that the faces left
+    // whole keep their shape
+    std::vector<Eigen::Vector3f> v_pos(n_vertices);
+    std::vector<std::uint8_t> moved(n_vertices, false);
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        if(vertexDeleted(v)) continue;
+        moved[v] = true;
+        for(Idx h : outgoing(v)) {
+            if(!split[edge(h)]) moved[v] = false;
+        }
+        if(!moved[v]) continue;
+
+        int n = degree(v);
+        float u = vertex_weight(n);
         Eigen::Vector3f new_pos = Eigen::Vector3f(0,0,0);
-        for(Eigen::Vector3f vert : surrounding) {
-            new_pos += u*vert;
+        for(Idx h : outgoing(v)) {
+            new_pos += u*position(vertex(twin(h)));
         }
-        new_pos+=(1-n*u)*v->pos;
-        v->pos = new_pos;
+        new_pos += (1-n*u)*position(v);
+        v_pos[v] = new_pos;
     }
+
+    Idx n_split = split_edges.size();
+    reserve(numVertices() + n_split, numEdges() + 3*n_split, numFaces() + 2*n_split);
+    Property<std::uint8_t> is_new = addVertexProperty<std::uint8_t>("loop:is_new", false);
+
+    // after edgeSplit(h), next(h) goes to the vertex across h's face and next(next(twin(h))) comes from the
+    // one across the twin's; in a green face that edge is the bisection, so it's kept out of the flips
+    for(Idx e : split_edges) {
+        Idx h = edgeHalfedge(e);
+        Idx t = twin(h);
+        bool green_left = green[face(h)];
+        bool green_right = green[face(t)];
+
+        Idx new_v = edgeSplit(h);
+        position(new_v) = edge_pos[e];
+        is_new[new_v] = true;
+        if(green_left) _e_is_new[edge(next(h))] = false;
+        if(green_right) _e_is_new[edge(next(next(t)))] = false;
+    }
+
+    // inside the red faces, flip new edges that touch a new and old vertex
+    for(Idx e : edges()) {
+        Idx h = edgeHalfedge(e);
+        if(_e_is_new[e] && is_new[vertex(h)] != is_new[vertex(twin(h))]) {
+            edgeFlip(h);
+        }
+        _e_is_new[e] = false;
+    }
+
+    for(Idx v = 0; v < n_vertices; v++) {
+        if(moved[v]) position(v) = v_pos[v];
+    }
+
+    removeFaceProperty("loop:green");
+    removeVertexProperty("loop:is_new");
+    return true;
 }
 
-void Mesh::loopSubdivision(int n) {
+void Mesh::adaptiveLoopSubdivision(int n, float tolerance) {
     for(int i = 0; i < n; i++) {
-        loopSubdivide();
+        if(!adaptiveLoopSubdivide(tolerance)) break;
     }
 }
@@ -4,9 +4,61 @@
 
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 
 #include "mesh.h"
+#include "progressive_mesh.h"
+#include "loop_stencils.h"
 
+// writes the progressive mesh's current level of detail as an .obj
+static void saveLevel(const ProgressiveMesh &pm, const QString &filePath)
+{
+    std::vector<Eigen::Vector3f> vertices;
+    std::vector<Eigen::Vector3i> faces;
+    pm.toVectors(vertices, faces);
+
+    Mesh lod;
+    lod.initFromVectors(vertices, faces);
+    lod.saveToFile(filePath.toStdString());
+}
+
+// collapses leave deleted slots behind, which subdivision has to compact away first; checks that the
+// result has the counts one Loop level gives, and that its recorded stencils reproduce it
+static bool testCollapseThenSubdivide(Mesh &m, int numCollapses)
+{
+    for (Idx h = 0; numCollapses > 0 && h < m.numHalfedgeSlots(); h++) {
+        if (!m.halfedgeDeleted(h) && m.edgeCollapse(h)) numCollapses--;
+    }
+    validate(m);
+
+    // the stencils are recorded on the collapsed mesh, by slot
+    std::vector<Eigen::Vector3f> control(m.numVertexSlots());
+    for (Idx v : m.vertices()) control[v] = m.position(v);
+
+    Idx numVertices = m.numVertices(), numEdges = m.numEdges(), numFaces = m.numFaces();
+    LoopStencils stencils;
+    m.loopSubdivision(1, &stencils);
+    validate(m);
+
+    bool ok = true;
+    auto check = [&](bool passed, const char *what) {
+        if (!passed) std::cerr << "test_subdivide failed: " << what << std::endl;
+        ok = ok && passed;
+    };
+    check(m.numVertices() == numVertices + numEdges && m.numVertices() == m.numVertexSlots(), "vertex count");
+    check(m.numEdges() == 2*numEdges + 3*numFaces && m.numEdges() == m.numEdgeSlots(), "edge count");
+    check(m.numFaces() == 4*numFaces && m.numFaces() == m.numFaceSlots(), "face count");
+
+    std::vector<Eigen::Vector3f> refined;
+    stencils.apply(control, refined);
+    check(stencils.numRefinedVertices() == m.numVertices() && stencils.faces().size() == m.numFaces(), "stencil table size");
+    if (ok) {
+        float residual = 0;
+        for (Idx v : m.vertices()) residual = std::max(residual, (refined[v] - m.position(v)).norm());
+        check(residual < 1e-4f, "stencil residual");
+    }
+    return ok;
+}
 
 int main(int argc, char *argv[])
 {
@@ -33,28 +85,56 @@ int main(int argc, char *argv[])
     // A note about the representations of other parameters in the .ini files for the various methods:
 
     // args1:
-    // Subdivide: number of iterations
-    // Simplify:  number of faces to remove
+    // Subdivide: number of iterations (subdivide_adaptive: at most this many; subdivide_sqrt3 takes the same)
+    // Simplify:  number of faces to remove (simplify_memoryless takes the same arguments)
+    // Simplify (parallel): number of faces to remove
+    // Simplify (random):   number of faces to remove
+    // Simplify (cluster):  grid cells along the longest side of the bounding box
+    // Simplify (out of core): number of faces to remove
+    // Progressive: number of faces to remove
+    // Replay:      number of faces to replay the .pm infile to
     // Remesh:    number of iterations
     // Denoise:   number of iterations
+    // Test (subdivide): number of edges to collapse before subdividing once and checking the result
 
     // args2:
+    // Subdivide: (optional) 1 to move the result onto the limit surface
+    // Subdivide (adaptive): how far an edge's new vertex may be from the edge before it is split
+    // Simplify: (optional) stop before any collapse costing more than this
     // Remesh: Tangential smoothing weight
+    // Simplify (parallel): how much costlier than the cheapest collapse the others in a round may be
+    // Simplify (random):   number of edges sampled per collapse
+    // Simplify (out of core): memory budget in MB
+    // Progressive: face counts to write levels of detail at, e.g. 10000, 5000, 1000
+    //              (written next to outfile as <name>_lod0.obj, ..., with the collapses in <name>.pm)
     // Denoise: Smoothing parameter 1 (\Sigma_c)
 
     // args3:
+    // Simplify: (optional) stop at this fraction of the faces
+    // Progressive: collapse errors to write further levels of detail at
     // Denoise: Smoothing parameter 2 (\Sigma_s)
 
     // args4:
+    // Simplify: (optional) stop at this many vertices
     // Denoise: Kernel size (\rho)
 
+    // args5:
+    // Simplify: (optional) first collapse flat regions, moving no face further than this fraction of the
+    //           bounding box diagonal (e.g. 1e-5; not used by simplify_memoryless)
+
 
-    // Load
+    // Load (a replay loads its .pm itself, out of core simplification streams the .obj, and clustering
+    // needs no halfedges)
     Mesh m;
-    m.loadFromFile(infile.toStdString());
+    if (method != "replay" && method != "simplify_out_of_core") {
+        m.loadFromFile(infile.toStdString(), method != "simplify_cluster");
+    }
 
     //validate(m);
 
+    // nonzero when a test method fails
+    int status = 0;
+
     // Start timing
     auto t0 = std::chrono::high_resolution_clock::now();
 
@@ -62,9 +142,71 @@ int main(int argc, char *argv[])
     if (method == "subdivide") {
         int numIterations = settings.value("Parameters/args1").toInt();
         m.loopSubdivision(numIterations);
-    } else if (method == "simplify") {
+        if (settings.value("Parameters/args2", 0).toInt()) {
+            m.loopLimitProjection();
+        }
+    } else if (method == "subdivide_sqrt3") {
+        int numIterations = settings.value("Parameters/args1").toInt();
+        m.sqrt3Subdivision(numIterations);
+    } else if (method == "subdivide_adaptive") {
+        int numIterations = settings.value("Parameters/args1").toInt();
+        float tolerance = settings.value("Parameters/args2").toFloat();
+        m.adaptiveLoopSubdivision(numIterations, tolerance);
+    } else if (method == "simplify" || method == "simplify_memoryless") {
+        int numFaces = settings.value("Parameters/args1").toInt();
+        SimplifyLimits limits;
+        limits.faces = numFaces < int(m.numFaces()) ? m.numFaces() - numFaces : 0;
+        limits.max_error = settings.value("Parameters/args2", std::numeric_limits<float>::infinity()).toFloat();
+        limits.face_ratio = settings.value("Parameters/args3", 0).toFloat();
+        limits.vertices = settings.value("Parameters/args4", 0).toInt();
+        limits.planar_tolerance = settings.value("Parameters/args5", 0).toFloat();
+        if (method == "simplify") {
+            m.quadricErrorSimplification(limits);
+        } else {
+            m.memorylessSimplification(limits);
+        }
+    } else if (method == "simplify_cluster") {
+        int resolution = settings.value("Parameters/args1").toInt();
+        m.clusterSimplification(resolution);
+    } else if (method == "simplify_out_of_core") {
+        int numFaces = settings.value("Parameters/args1").toInt();
+        std::size_t budget = std::size_t(settings.value("Parameters/args2").toInt()) << 20;
+        m.outOfCoreSimplification(infile.toStdString(), numFaces, budget);
+    } else if (method == "simplify_parallel") {
+        int numFaces = settings.value("Parameters/args1").toInt();
+        float tolerance = settings.value("Parameters/args2").toFloat();
+        m.parallelQuadricErrorSimplification(numFaces, tolerance);
+    } else if (method == "simplify_random") {
+        int numFaces = settings.value("Parameters/args1").toInt();
+        int numSamples = settings.value("Parameters/args2").toInt();
+        m.randomQuadricErrorSimplification(numFaces, numSamples);
+    } else if (method == "progressive") {
         int numFaces = settings.value("Parameters/args1").toInt();
-        m.quadricErrorSimplification(numFaces);
+        ProgressiveMesh pm;
+        m.quadricErrorSimplification(numFaces, &pm);
+
+        QFileInfo info(outfile);
+        QString base = info.path() + "/" + info.completeBaseName();
+        pm.save((base + ".pm").toStdString());
+
+        int lod = 0;
+        for (const QString &count : settings.value("Parameters/args2").toStringList()) {
+            pm.setLevel(pm.levelForFaces(count.toInt()));
+            saveLevel(pm, base + "_lod" + QString::number(lod++) + ".obj");
+        }
+        for (const QString &error : settings.value("Parameters/args3").toStringList()) {
+            pm.setLevel(pm.levelForError(error.toFloat()));
+            saveLevel(pm, base + "_lod" + QString::number(lod++) + ".obj");
+        }
+    } else if (method == "replay") {
+        ProgressiveMesh pm;
+        if (pm.load(infile.toStdString())) {
+            pm.setLevel(pm.levelForFaces(settings.value("Parameters/args1").toInt()));
+            std::vector<Eigen::Vector3f> vertices;
+            std::vector<Eigen::Vector3i> faces;
+            pm.toVectors(vertices, faces);
+            m.initFromVectors(vertices, faces);
+        }
     } else if (method == "remesh") {
         int numIterations = settings.value("Parameters/args1").toInt();
         float damping = settings.value("Parameters/args2").toFloat();
@@ -78,7 +220,10 @@ int main(int argc, char *argv[])
         // TODO
 
     } else if (method == "test") {
-        m.edgeCollapse(m.getHalfedges().begin()->first);
+        m.edgeCollapse(0);
+    } else if (method == "test_subdivide") {
+        int numCollapses = settings.value("Parameters/args1", 1).toInt();
+        if (!testCollapseThenSubdivide(m, numCollapses)) status = 1;
     } else {
 
         std::cerr << "Error: Unknown method \"" << method.toUtf8().constData() << "\"" << std::endl;
@@ -95,5 +240,6 @@ int main(int argc, char *argv[])
     // Save
     m.saveToFile(outfile.toStdString());
 
-    a.exit();
+    a.exit(status);
+    return status;
 }
@@ -1,4 +1,5 @@
 #include "mesh.h"
+#include "parallel_utils.h"
 
 #include <iostream>
 #include <fstream>
@@ -8,6 +9,7 @@
 #include <cassert>
 #include <set>
 #include <map>
+#include <bit>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "util/tiny_obj_loader.h"
@@ -25,7 +27,7 @@ void Mesh::initFromVectors(const vector<Vector3f> &vertices,
     buildHalfedges();
 }
 
-void Mesh::loadFromFile(const string &filePath)
+void Mesh::loadFromFile(const string &filePath, bool halfedges)
 {
     tinyobj::attrib_t attrib;
     vector<tinyobj::shape_t> shapes;
@@ -64,14 +66,18 @@ void Mesh::loadFromFile(const string &filePath)
         _vertices.emplace_back(attrib.vertices[i], attrib.vertices[i + 1], attrib.vertices[i + 2]);
     }
 
-    buildHalfedges();
+    if (halfedges) {
+        buildHalfedges();
+    }
 
     cout << "Loaded " << _faces.size() << " faces and " << _vertices.size() << " vertices" << endl;
 }
 
 void Mesh::saveToFile(const string &filePath)
 {
-    exportHalfedges();
+    if (_has_halfedges) {
+        exportHalfedges();
+    }
 
     ofstream outfile;
     outfile.open(filePath);
@@ -93,144 +99,293 @@ void Mesh::saveToFile(const string &filePath)
     outfile.close();
 }
 
-void Mesh::buildHalfedges() {
-    std::vector<Vertex*> v_list;
-    std::map<std::pair<int, int>, Edge*> e_list;
+void Mesh::reserve(Idx n_vertices, Idx n_edges, Idx n_faces) {
+    _v_halfedge.reserve(n_vertices);
+    _v_pos.reserve(n_vertices);
+    _v_degree.reserve(n_vertices);
 
-    for (Eigen::Vector3f &vpoint : _vertices) {
-        Vertex *v = new Vertex;
-        v->pos = vpoint;
-        v_list.push_back(v);
-    }
+    _e_halfedge.reserve(n_edges);
+    _e_is_new.reserve(n_edges);
 
-    for(Eigen::Vector3i fvertices : _faces)
-    {
-        int v1 = fvertices[0];
-        int v2 = fvertices[1];
-        int v3 = fvertices[2];
-
-        Face *f = new Face;
-        Halfedge *he1 = new Halfedge /*1 to 2*/, *he2 = new Halfedge /*2 to 3*/, *he3 = new Halfedge /*3 to 1*/;
-        Edge *e1 = new Edge /*1 to 2*/, *e2 = new Edge/*2 to 3*/, *e3 = new Edge /*3 to 1*/;
-        he1->face = f;
-        he2->face = f;
-        he3->face = f;
-        f->halfedge = he1;
-        if(e_list.find(std::make_pair(v1,v2)) == e_list.end()) {
-            e_list[std::make_pair(v1,v2)] = e1;
-            e_list[std::make_pair(v2,v1)] = e1;
-        } else {
-            e1 = e_list[std::make_pair(v1,v2)];
-            he1->twin = e1->halfedge;
-            he1->twin->twin = he1;
-        }
-        if(e_list.find(std::make_pair(v2,v3)) == e_list.end()) {
-            e_list[std::make_pair(v2,v3)] = e2;
-            e_list[std::make_pair(v3,v2)] = e2;
-        } else {
-            e2 = e_list[std::make_pair(v2,v3)];
-            he2->twin = e2->halfedge;
-            he2->twin->twin = he2;
-        }
-        if(e_list.find(std::make_pair(v3,v1)) == e_list.end()) {
-            e_list[std::make_pair(v3,v1)] = e3;
-            e_list[std::make_pair(v1,v3)] = e3;
-        } else {
-            e3 = e_list[std::make_pair(v3,v1)];
-            he3->twin = e3->halfedge;
-            he3->twin->twin = he3;
-        }
-        he1->edge = e1;
-        he2->edge = e2;
-        he3->edge = e3;
+    _f_halfedge.reserve(n_faces);
 
-        e1->halfedge = he1;
-        e2->halfedge = he2;
-        e3->halfedge = he3;
+    _vertex_props.reserve(n_vertices);
+    _edge_props.reserve(n_edges);
+    _face_props.reserve(n_faces);
+    _halfedge_props.reserve(2*n_edges);
 
-        v_list[v1]->halfedge = he1;
-        v_list[v2]->halfedge = he2;
-        v_list[v3]->halfedge = he3;
+    _he_next.reserve(2*n_edges);
+    _he_twin.reserve(2*n_edges);
+    _he_vertex.reserve(2*n_edges);
+    _he_edge.reserve(2*n_edges);
+    _he_face.reserve(2*n_edges);
+}
+
+// new elements reuse a deleted slot when there is one, and only grow the arrays otherwise
+Idx Mesh::newVertex(const Eigen::Vector3f &pos) {
+    if(!_free.vertices.empty()) {
+        Idx v = _free.vertices.back();
+        _free.vertices.pop_back();
+        _v_pos[v] = pos;
+        _v_degree[v] = 0;
+        _vertex_props.reset(v);
+        return v;
+    }
+    _v_halfedge.push_back(INVALID);
+    _v_pos.push_back(pos);
+    _v_degree.push_back(0);
+    _vertex_props.resize(_v_halfedge.size());
+    return _v_halfedge.size() - 1;
+}
 
-        he1->vertex = v_list[v1];
-        he2->vertex = v_list[v2];
-        he3->vertex = v_list[v3];
+Idx Mesh::newEdge() {
+    if(!_free.edges.empty()) {
+        Idx e = _free.edges.back();
+        _free.edges.pop_back();
+        _e_is_new[e] = false;
+        _edge_props.reset(e);
+        return e;
+    }
+    _e_halfedge.push_back(INVALID);
+    _e_is_new.push_back(false);
+    _edge_props.resize(_e_halfedge.size());
+    return _e_halfedge.size() - 1;
+}
 
-        he1->next = he2;
-        he2->next = he3;
-        he3->next = he1;
+Idx Mesh::newFace() {
+    if(!_free.faces.empty()) {
+        Idx f = _free.faces.back();
+        _free.faces.pop_back();
+        _face_props.reset(f);
+        return f;
+    }
+    _f_halfedge.push_back(INVALID);
+    _face_props.resize(_f_halfedge.size());
+    return _f_halfedge.size() - 1;
+}
 
-        _halfedges[he1]=he1;
-        _halfedges[he2]=he2;
-        _halfedges[he3]=he3;
+Idx Mesh::newHalfedge() {
+    if(!_free.halfedges.empty()) {
+        Idx h = _free.halfedges.back();
+        _free.halfedges.pop_back();
+        _halfedge_props.reset(h);
+        return h;
     }
+    _he_next.push_back(INVALID);
+    _he_twin.push_back(INVALID);
+    _he_vertex.push_back(INVALID);
+    _he_edge.push_back(INVALID);
+    _he_face.push_back(INVALID);
+    _halfedge_props.resize(_he_next.size());
+    return _he_next.size() - 1;
 }
 
-void Mesh::exportHalfedges() {
-    std::map<Vertex*, int> v_list;
-    std::set<Face*> seen;
-    int v_idx = 0;
-
-    _vertices.clear();
-    _faces.clear();
-
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(seen.contains(h->face)) {continue;}
-        seen.insert(h->face);
-
-        Vertex *v1 = h->vertex;
-        Vertex *v2 = h->next->vertex;
-        Vertex *v3 = h->next->next->vertex;
-
-        if(!v_list.contains(v1)) {
-            v_list[v1] = v_idx;
-            v_idx++;
-            _vertices.push_back(v1->pos);
+// deleted elements are marked by an INVALID halfedge (or next, for halfedges)
+void Mesh::deleteVertex(Idx v, FreeLists &freed) {
+    _v_halfedge[v] = INVALID;
+    freed.vertices.push_back(v);
+}
+
+void Mesh::deleteEdge(Idx e, FreeLists &freed) {
+    _e_halfedge[e] = INVALID;
+    freed.edges.push_back(e);
+}
+
+void Mesh::deleteFace(Idx f, FreeLists &freed) {
+    _f_halfedge[f] = INVALID;
+    freed.faces.push_back(f);
+}
+
+void Mesh::deleteHalfedge(Idx h, FreeLists &freed) {
+    _he_next[h] = INVALID;
+    _he_twin[h] = INVALID;
+    _he_vertex[h] = INVALID;
+    _he_edge[h] = INVALID;
+    _he_face[h] = INVALID;
+    freed.halfedges.push_back(h);
+}
+
+void Mesh::buildHalfedges() {
+    const Idx n_vertices = _vertices.size();
+    const Idx n_faces = _faces.size();
+    const Idx n_halfedges = 3*n_faces;
+
+    _has_halfedges = true;
+    _free = FreeLists();
+
+    _v_halfedge.assign(n_vertices, INVALID);
+    _v_pos = _vertices;
+    _v_degree.assign(n_vertices, 0);
+
+    _f_halfedge.resize(n_faces);
+
+    _he_next.resize(n_halfedges);
+    _he_twin.assign(n_halfedges, INVALID);
+    _he_vertex.resize(n_halfedges);
+    _he_edge.resize(n_halfedges);
+    _he_face.resize(n_halfedges);
+
+    _vertex_props.resize(n_vertices);
+    _face_props.resize(n_faces);
+    _halfedge_props.resize(n_halfedges);
+
+    // halfedge 3f+i goes from corner i to corner i+1 of face f,
+    // and is keyed by its (unordered) endpoints so that twins sort next to each other
+    const int vertex_bits = std::bit_width(n_vertices);
+    vector<uint64_t> keys(n_halfedges);
+    vector<Idx> sorted(n_halfedges);
+
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        _f_halfedge[f] = 3*f;
+        for(Idx i = 0; i < 3; i++) {
+            Idx h = 3*f + i;
+            Idx a = _faces[f][i];
+            Idx b = _faces[f][(i+1)%3];
+            _he_next[h] = 3*f + (i+1)%3;
+            _he_vertex[h] = a;
+            _he_face[h] = f;
+            keys[h] = (uint64_t(std::min(a,b)) << vertex_bits) | std::max(a,b);
+            sorted[h] = h;
         }
+    }
+
+    for(Idx h = 0; h < n_halfedges; h++) {
+        _v_halfedge[_he_vertex[h]] = h;
+        _v_degree[_he_vertex[h]]++;
+    }
+
+    // vertices no face uses have nothing to hang off, so they start out deleted
+    for(Idx v = 0; v < n_vertices; v++) {
+        if(_v_halfedge[v] == INVALID) _free.vertices.push_back(v);
+    }
+
+    radixSort(keys, sorted, 2*vertex_bits);
+
+    // twins are the first two halfedges of each run of equal keys, and share an edge;
+    // every other halfedge starts an edge of its own (a boundary, or a non-manifold extra)
+    auto pairedWithPrevious = [&](Idx i) {
+        return i >= 1 && keys[i] == keys[i-1] && (i < 2 || keys[i-2] != keys[i-1]);
+    };
 
-        if(!v_list.contains(v2)) {
-            v_list[v2] = v_idx;
-            v_idx++;
-            _vertices.push_back(v2->pos);
+    // counted and numbered per block, as in radixSort
+    const int n_blocks = omp_get_max_threads();
+    vector<Idx> edge_offsets(n_blocks+1, 0);
+    auto blockBegin = [&](int b) {return Idx(uint64_t(n_halfedges)*b/n_blocks);};
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static)
+        for(int b = 0; b < n_blocks; b++) {
+            Idx n_edges = 0;
+            for(Idx i = blockBegin(b); i < blockBegin(b+1); i++) {
+                if(!pairedWithPrevious(i)) n_edges++;
+            }
+            edge_offsets[b+1] = n_edges;
         }
 
-        if(!v_list.contains(v3)) {
-            v_list[v3] = v_idx;
-            v_idx++;
-            _vertices.push_back(v3->pos);
+        #pragma omp single
+        {
+            for(int b = 0; b < n_blocks; b++) edge_offsets[b+1] += edge_offsets[b];
+            _e_halfedge.resize(edge_offsets[n_blocks]);
+            _e_is_new.assign(edge_offsets[n_blocks], false);
+            _edge_props.resize(edge_offsets[n_blocks]);
         }
 
-        _faces.push_back(Eigen::Vector3i(v_list[v1], v_list[v2], v_list[v3]));
+        #pragma omp for schedule(static)
+        for(int b = 0; b < n_blocks; b++) {
+            Idx e = edge_offsets[b];
+            for(Idx i = blockBegin(b); i < blockBegin(b+1); i++) {
+                if(pairedWithPrevious(i)) continue;
+
+                Idx h = sorted[i];
+                _he_edge[h] = e;
+                _e_halfedge[e] = h;
+                if(i+1 < n_halfedges && pairedWithPrevious(i+1)) {
+                    Idx twin = sorted[i+1];
+                    _he_edge[twin] = e;
+                    _he_twin[h] = twin;
+                    _he_twin[twin] = h;
+                }
+                e++;
+            }
+        }
     }
 }
 
-void validate(Mesh &mesh) {
-    std::unordered_map<Halfedge*, Halfedge*> halfedges = mesh.getHalfedges();
+void Mesh::exportHalfedges() {
+    // surviving vertices keep their relative order, and each face is visited once
+    vector<Idx> v_index;
+    vector<Idx> f_index;
+    Idx n_vertices = compactIndices(numVertexSlots(), [&](Idx v) {return !vertexDeleted(v);}, v_index);
+    Idx n_faces = compactIndices(numFaceSlots(), [&](Idx f) {return !faceDeleted(f);}, f_index);
+
+    _vertices.resize(n_vertices);
+    _faces.resize(n_faces);
+
+    #pragma omp parallel for
+    for(Idx v = 0; v < numVertexSlots(); v++) {
+        if(v_index[v] != INVALID) _vertices[v_index[v]] = position(v);
+    }
+
+    #pragma omp parallel for
+    for(Idx f = 0; f < numFaceSlots(); f++) {
+        if(f_index[f] == INVALID) continue;
+        Idx h = faceHalfedge(f);
+        _faces[f_index[f]] = Eigen::Vector3i(v_index[vertex(h)], v_index[vertex(next(h))], v_index[vertex(next(next(h)))]);
+    }
+}
 
+void Mesh::compact() {
+    if(_free.vertices.empty() && _free.edges.empty() && _free.faces.empty() && _free.halfedges.empty()) return;
+    exportHalfedges();
+    buildHalfedges();
+}
+
+void Mesh::releaseHalfedges() {
+    _has_halfedges = false;
+
+    // swapping with empty arrays frees the memory, which clear() would keep
+    vector<Idx>().swap(_he_next);
+    vector<Idx>().swap(_he_twin);
+    vector<Idx>().swap(_he_vertex);
+    vector<Idx>().swap(_he_edge);
+    vector<Idx>().swap(_he_face);
+    vector<Idx>().swap(_v_halfedge);
+    vector<Vector3f>().swap(_v_pos);
+    vector<Idx>().swap(_v_degree);
+    vector<Idx>().swap(_e_halfedge);
+    vector<uint8_t>().swap(_e_is_new);
+    vector<Idx>().swap(_f_halfedge);
+    _free = FreeLists();
+
+    _vertex_props.resize(0);
+    _edge_props.resize(0);
+    _face_props.resize(0);
+    _halfedge_props.resize(0);
+}
+
+void validate(Mesh &mesh) {
     // Tests 0-4 : half edges have all fields
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        assert(h != nullptr);
-        assert(h->edge != nullptr);
-        assert(h->edge->halfedge != nullptr);
+    for(Idx h : mesh.halfedges()) {
+        assert(mesh.edge(h) != INVALID);
+        assert(mesh.edgeHalfedge(mesh.edge(h)) != INVALID);
 
-        assert(h->face != nullptr);
-        assert(h->face->halfedge != nullptr);
+        assert(mesh.face(h) != INVALID);
+        assert(mesh.faceHalfedge(mesh.face(h)) != INVALID);
 
-        assert(h->next != nullptr);
+        assert(mesh.next(h) != INVALID);
 
-        assert(h->twin != nullptr);
+        assert(mesh.twin(h) != INVALID);
 
-        assert(h->vertex != nullptr);
-        assert(h->vertex->halfedge != nullptr);
+        assert(mesh.vertex(h) != INVALID);
+        assert(mesh.vertexHalfedge(mesh.vertex(h)) != INVALID);
     }
 
     // Test 5 : each half edge has two edges
-    std::map<Edge*, int> seen;
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        seen[h->edge] += 1;
+    std::map<Idx, int> seen;
+    for(Idx h : mesh.halfedges()) {
+        seen[mesh.edge(h)] += 1;
     }
 
     for (const auto& pair : seen) {
@@ -238,46 +393,41 @@ void validate(Mesh &mesh) {
     }
 
     // Test 6 : we can follow halfedges in a loop around a face back to the original one
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        assert(h->next->next->next == h);
+    for(Idx h : mesh.halfedges()) {
+        assert(mesh.next(mesh.next(mesh.next(h))) == h);
     }
 
     // Test 7 : halfedges are twins of each other
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        assert(h->twin->twin == h);
+    for(Idx h : mesh.halfedges()) {
+        assert(mesh.twin(mesh.twin(h)) == h);
     }
 
     // Test 8 : follow the halfedges around a vertex, they should share that vertex
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        Vertex *v = h->vertex;
-        Halfedge *start = h;
+    for(Idx start : mesh.halfedges()) {
+        Idx v = mesh.vertex(start);
+        Idx h = start;
         do {
-            assert(h->vertex == v);
-            h = h->twin->next;
+            assert(mesh.vertex(h) == v);
+            h = mesh.next(mesh.twin(h));
         }
         while(h != start);
     }
 
     // Test 9 : we have a disc around a vertex
     // (if we follow the disc around that vertex, we see all of the halfedges that originate from it)
-    std::map<Vertex*, std::set<Halfedge*>> neighborhoods;
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        neighborhoods[h->vertex].insert(h);
+    std::map<Idx, std::set<Idx>> neighborhoods;
+    for(Idx h : mesh.halfedges()) {
+        neighborhoods[mesh.vertex(h)].insert(h);
     }
 
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        std::set<Halfedge*> neighborhood;
+    for(Idx start : mesh.halfedges()) {
+        std::set<Idx> neighborhood;
 
-        Vertex *v = h->vertex;
-        Halfedge *start = h;
+        Idx v = mesh.vertex(start);
+        Idx h = start;
         do {
             neighborhood.insert(h);
-            h = h->twin->next;
+            h = mesh.next(mesh.twin(h));
         }
         while(h != start);
 
@@ -285,10 +435,14 @@ void validate(Mesh &mesh) {
     }
 
     // Test 10 : halfedges of same face share that face
-    for(auto &pair : halfedges) {
-        Halfedge *h = pair.first;
-        Face *f = h->face;
-        assert(h->next->face == f);
-        assert(h->next->next->face == f);
+    for(Idx h : mesh.halfedges()) {
+        Idx f = mesh.face(h);
+        assert(mesh.face(mesh.next(h)) == f);
+        assert(mesh.face(mesh.next(mesh.next(h))) == f);
+    }
+
+    // Test 11 : the cached vertex degrees match the one-rings
+    for(Idx v : mesh.vertices()) {
+        assert(mesh.degree(v) == mesh.countDegree(v));
     }
 }
@@ -1,16 +1,106 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+// let the OpenMP-parallel loops run serially when building without it
+inline int omp_get_max_threads() {return 1;}
+inline int omp_get_thread_num() {return 0;}
+#endif
 
 #include "Eigen/StdVector"
 #include "Eigen/Dense"
 
+#include "properties.h"
+
 EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(Eigen::Matrix2f);
 EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(Eigen::Matrix3f);
 EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(Eigen::Matrix3i);
 
-struct Halfedge;
-struct Vertex;
+// vertices, edges, faces and halfedges are referred to by their Idx into the mesh's arrays
+constexpr Idx INVALID = std::numeric_limits<Idx>::max();
+
+// the live elements of one of the mesh's arrays, found by skipping the slots marked INVALID
+// (elements added while iterating may or may not be visited)
+class ElementRange
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(const std::vector<Idx> *marker, Idx i) : _marker(marker), _i(i) {skipDeleted();}
+
+        Idx operator*() const {return _i;}
+        iterator &operator++() {_i++; skipDeleted(); return *this;}
+        bool operator!=(const iterator &other) const {return _i != other._i;}
+
+    private:
+        const std::vector<Idx> *_marker;
+        Idx _i;
+
+        void skipDeleted() {while(_i < _marker->size() && (*_marker)[_i] == INVALID) _i++;}
+    };
+
+    explicit ElementRange(const std::vector<Idx> &marker) : _marker(&marker), _end(marker.size()) {}
+
+    iterator begin() const {return iterator(_marker, 0);}
+    iterator end() const {return iterator(_marker, _end);}
+
+private:
+    const std::vector<Idx> *_marker;
+    Idx _end;
+};
+
+// the halfedges leaving a vertex, in ccw order
+class OutgoingRange
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(const std::vector<Idx> *next, const std::vector<Idx> *twin, Idx h, bool started) : _next(next), _twin(twin), _h(h), _started(started) {}
+
+        Idx operator*() const {return _h;}
+        iterator &operator++() {_h = (*_next)[(*_twin)[_h]]; _started = true; return *this;}
+        bool operator!=(const iterator &other) const {return _h != other._h || _started != other._started;}
+
+    private:
+        const std::vector<Idx> *_next;
+        const std::vector<Idx> *_twin;
+        Idx _h;
+        bool _started;
+    };
+
+    OutgoingRange(const std::vector<Idx> &next, const std::vector<Idx> &twin, Idx start) : _next(&next), _twin(&twin), _start(start) {}
+
+    iterator begin() const {return iterator(_next, _twin, _start, false);}
+    iterator end() const {return iterator(_next, _twin, _start, true);}
+
+private:
+    const std::vector<Idx> *_next;
+    const std::vector<Idx> *_twin;
+    Idx _start;
+};
+
+class ProgressiveMesh;
+class LoopStencils;
+
+// when simplification stops: at whichever of these is reached first
+struct SimplifyLimits
+{
+    Idx faces = 0; // this many faces or fewer
+    float face_ratio = 0; // this fraction of the starting faces or less
+    Idx vertices = 0; // this many vertices or fewer
+    float max_error = std::numeric_limits<float>::infinity(); // the cheapest collapse left costs more than this
+
+    // if nonzero, quadricErrorSimplification first collapses the vertices inside flat regions and along
+    // straight creases, wherever that moves no face further than this fraction of the bounding box diagonal
+    float planar_tolerance = 0;
+};
 
 class Mesh
 {
@@ -20,57 +110,181 @@ public:
     void initFromVectors(const std::vector<Eigen::Vector3f> &vertices,
                          const std::vector<Eigen::Vector3i> &faces);
 
-    void loadFromFile(const std::string &filePath);
+    // without building halfedges, only the face list methods (clusterSimplification) can run on it
+    void loadFromFile(const std::string &filePath, bool halfedges = true);
     void saveToFile(const std::string &filePath);
 
-   std::unordered_map<Halfedge*, Halfedge*> getHalfedges() {return _halfedges;}
+   // halfedge connectivity
+   Idx next(Idx h) const {return _he_next[h];} // ccw
+   Idx twin(Idx h) const {return _he_twin[h];}
+   Idx vertex(Idx h) const {return _he_vertex[h];} // vertex it originates from
+   Idx edge(Idx h) const {return _he_edge[h];}
+   Idx face(Idx h) const {return _he_face[h];}
+
+   Idx vertexHalfedge(Idx v) const {return _v_halfedge[v];} // half edge leaving from it
+   Idx edgeHalfedge(Idx e) const {return _e_halfedge[e];}
+   Idx faceHalfedge(Idx f) const {return _f_halfedge[f];}
+
+   Eigen::Vector3f &position(Idx v) {return _v_pos[v];}
+   const Eigen::Vector3f &position(Idx v) const {return _v_pos[v];}
+
+   // live elements, e.g. for(Idx v : mesh.vertices())
+   ElementRange vertices() const {return ElementRange(_v_halfedge);}
+   ElementRange edges() const {return ElementRange(_e_halfedge);}
+   ElementRange faces() const {return ElementRange(_f_halfedge);}
+   ElementRange halfedges() const {return ElementRange(_he_next);}
 
-   bool edgeFlip(Halfedge *halfedge);
+   // one-ring of a vertex, e.g. for(Idx h : mesh.outgoing(v)) mesh.vertex(mesh.twin(h)) is a neighbor
+   OutgoingRange outgoing(Idx v) const {return OutgoingRange(_he_next, _he_twin, _v_halfedge[v]);}
 
-   Vertex *edgeSplit(Halfedge *halfedge);
+   // number of slots in each array, deleted elements included
+   Idx numVertexSlots() const {return _v_halfedge.size();}
+   Idx numEdgeSlots() const {return _e_halfedge.size();}
+   Idx numFaceSlots() const {return _f_halfedge.size();}
+   Idx numHalfedgeSlots() const {return _he_next.size();}
 
-   bool edgeCollapse(Halfedge *halfedge);
+   // number of live elements
+   Idx numVertices() const {return _v_halfedge.size() - _free.vertices.size();}
+   Idx numEdges() const {return _e_halfedge.size() - _free.edges.size();}
+   Idx numFaces() const {return _f_halfedge.size() - _free.faces.size();}
+   Idx numHalfedges() const {return _he_next.size() - _free.halfedges.size();}
 
-   void loopSubdivision(int n);
+   // grow the element arrays ahead of time, e.g. before a round of edge splits
+   void reserve(Idx n_vertices, Idx n_edges, Idx n_faces);
+
+   bool vertexDeleted(Idx v) const {return _v_halfedge[v] == INVALID;}
+   bool edgeDeleted(Idx e) const {return _e_halfedge[e] == INVALID;}
+   bool faceDeleted(Idx f) const {return _f_halfedge[f] == INVALID;}
+   bool halfedgeDeleted(Idx h) const {return _he_next[h] == INVALID;}
+
+   // per-element attributes, e.g. auto area = mesh.addVertexProperty<float>("area");
+   template<typename T> Property<T> addVertexProperty(const std::string &name, const T &value = zeroValue<T>()) {return _vertex_props.add<T>(name, value);}
+   template<typename T> Property<T> addEdgeProperty(const std::string &name, const T &value = zeroValue<T>()) {return _edge_props.add<T>(name, value);}
+   template<typename T> Property<T> addFaceProperty(const std::string &name, const T &value = zeroValue<T>()) {return _face_props.add<T>(name, value);}
+   template<typename T> Property<T> addHalfedgeProperty(const std::string &name, const T &value = zeroValue<T>()) {return _halfedge_props.add<T>(name, value);}
+
+   template<typename T> Property<T> getVertexProperty(const std::string &name) {return _vertex_props.get<T>(name);}
+   template<typename T> Property<T> getEdgeProperty(const std::string &name) {return _edge_props.get<T>(name);}
+   template<typename T> Property<T> getFaceProperty(const std::string &name) {return _face_props.get<T>(name);}
+   template<typename T> Property<T> getHalfedgeProperty(const std::string &name) {return _halfedge_props.get<T>(name);}
+
+   void removeVertexProperty(const std::string &name) {_vertex_props.remove(name);}
+   void removeEdgeProperty(const std::string &name) {_edge_props.remove(name);}
+   void removeFaceProperty(const std::string &name) {_face_props.remove(name);}
+   void removeHalfedgeProperty(const std::string &name) {_halfedge_props.remove(name);}
+
+   // number of edges at a vertex, kept up to date by the atomic operations
+   int degree(Idx v) const;
+   // the same, counted by walking the one-ring
+   int countDegree(Idx v) const;
+
+   // whether collapsing the edge keeps the mesh manifold
+   bool canCollapse(Idx halfedge) const;
+
+   bool edgeFlip(Idx halfedge);
+
+   Idx edgeSplit(Idx halfedge);
+
+   bool edgeCollapse(Idx halfedge);
+
+   // the refinement is recorded into `record` if given, to redo it for new positions, see loop_stencils.h
+   void loopSubdivision(int n, LoopStencils *record = nullptr);
+   // the point of Loop's limit surface that a vertex converges to, and the surface's unit normal there
+   Eigen::Vector3f loopLimitPosition(Idx v) const;
+   Eigen::Vector3f loopLimitNormal(Idx v) const;
+   // moves every vertex onto the limit surface, e.g. after a few levels instead of many more
+   void loopLimitProjection();
+   // up to n levels of Loop subdivision, splitting only the edges whose new vertex would be further than
+   // `tolerance` from the edge, with the faces around them bisected (red-green) to keep the mesh conforming
+   void adaptiveLoopSubdivision(int n, float tolerance);
+
+   // Kobbelt's √3 subdivision, which triples the faces each level where Loop quadruples them
+   void sqrt3Subdivision(int n);
 
    void remesh(int n, float damping);
 
-   void quadricErrorSimplification(int n);
+   // removes n faces; collapses are recorded into `record` if given, see progressive_mesh.h.
+   // vertices with a nonzero std::uint8_t "locked" property are kept where they are
+   void quadricErrorSimplification(int n, ProgressiveMesh *record = nullptr);
+   void quadricErrorSimplification(const SimplifyLimits &limits, ProgressiveMesh *record = nullptr);
+   // costs collapses from the current faces alone (volume preservation), keeping no quadrics
+   void memorylessSimplification(const SimplifyLimits &limits);
+   // collapses rounds of non-adjacent edges at once, each costing at most (1+tolerance) times the cheapest
+   void parallelQuadricErrorSimplification(int n, float tolerance);
+   // collapses the cheapest of k random edges at a time, without a priority queue
+   void randomQuadricErrorSimplification(int n, int k);
+   // merges the vertices in each cell of a grid `resolution` cells across, working on the face list;
+   // the result can be non-manifold, so it is left without halfedges
+   void clusterSimplification(int resolution);
+   // reads the .obj at filePath and removes n faces from it a spatial chunk at a time, so that no more than
+   // about memory_budget bytes are in use beyond the result; chunk borders are locked and done last
+   void outOfCoreSimplification(const std::string &filePath, int n, std::size_t memory_budget);
 private:
     std::vector<Eigen::Vector3f> _vertices;
     std::vector<Eigen::Vector3i> _faces;
-    std::unordered_map<Halfedge*, Halfedge*> _halfedges;
 
-    void buildHalfedges();
-    void exportHalfedges();
-    void loopSubdivide();
-    bool canCollapse(Halfedge *h);
+    // halfedge mesh, stored as one array per field
+    std::vector<Idx> _he_next;
+    std::vector<Idx> _he_twin;
+    std::vector<Idx> _he_vertex;
+    std::vector<Idx> _he_edge;
+    std::vector<Idx> _he_face;
 
-    void remesh_iteration(float damping);
-};
+    std::vector<Idx> _v_halfedge;
+    std::vector<Eigen::Vector3f> _v_pos;
+    std::vector<Idx> _v_degree;
 
-struct Vertex {
-    Halfedge *halfedge; // half edge leaving from it
-    Eigen::Vector3f pos;
-};
+    std::vector<Idx> _e_halfedge;
+    std::vector<std::uint8_t> _e_is_new;
 
-struct Edge {
-    Halfedge *halfedge;
-    bool is_new;
-};
+    std::vector<Idx> _f_halfedge;
 
-struct Face {
-    Halfedge *halfedge;
-};
+    // whether the arrays above describe the mesh, or only _vertices/_faces do
+    bool _has_halfedges = false;
+
+    // deleted slots, handed back out by the next newVertex/newEdge/...
+    struct FreeLists
+    {
+        std::vector<Idx> vertices;
+        std::vector<Idx> edges;
+        std::vector<Idx> faces;
+        std::vector<Idx> halfedges;
+    };
+    FreeLists _free;
+
+    PropertyContainer _vertex_props;
+    PropertyContainer _edge_props;
+    PropertyContainer _face_props;
+    PropertyContainer _halfedge_props;
+
+    Idx newVertex(const Eigen::Vector3f &pos);
+    Idx newEdge();
+    Idx newFace();
+    Idx newHalfedge();
+
+    // operations running concurrently free their slots into their own lists, merged afterwards
+    void deleteVertex(Idx v, FreeLists &freed);
+    void deleteEdge(Idx e, FreeLists &freed);
+    void deleteFace(Idx f, FreeLists &freed);
+    void deleteHalfedge(Idx h, FreeLists &freed);
+
+    // edgeCollapse without the link condition check
+    void collapse(Idx halfedge, FreeLists &freed);
 
-struct Halfedge {
-    Halfedge *twin;
-    Halfedge *next; // ccw
-    Vertex *vertex; // vertex it originates from
-    Edge *edge;
-    Face *face;
+    // the zero-error collapses of flat regions and straight creases, ahead of quadricErrorSimplification's heap
+    void collapsePlanarVertices(Idx target_faces, Idx min_vertices, double max_offset, ProgressiveMesh *record);
+
+    void buildHalfedges();
+    void exportHalfedges();
+    void releaseHalfedges();
+    // renumbers the elements without the deleted slots, which the subdivisions' index arithmetic relies on;
+    // a subdivision level leaves none behind, so it is called once before the first
+    void compact();
+    void loopSubdivide();
+    bool adaptiveLoopSubdivide(float tolerance);
+    void sqrt3Subdivide();
+
+    void remesh_iteration(float damping);
 };
 
 void validate(Mesh &mesh);
-
-int degree(Vertex *v);
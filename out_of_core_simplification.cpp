@@ -0,0 +1,408 @@
+#include "mesh.h"
+#include "parallel_utils.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cmath>
+#include <unordered_map>
+#include <bit>
+
+#include <QTemporaryFile>
+
+using namespace Eigen;
+using namespace std;
+
+// what a face of a chunk costs while the chunk is simplified: its halfedge mesh, the face list it is
+// built from, and the quadrics, targets and heap of the simplification (measured, with some slack)
+constexpr size_t BYTES_PER_FACE = 320;
+
+// faces are first counted in a grid of 2^COUNT_BITS cells a side, whose cells are then grouped into chunks
+constexpr int COUNT_BITS = 5;
+
+// an array in a temporary file, written front to back (or resized) and then used through a memory map,
+// so that the OS pages it in and out instead of it taking up memory of its own
+template<typename T>
+class DiskArray
+{
+public:
+    DiskArray() {_file.open();}
+
+    Idx size() const {return _size;}
+
+    void push_back(const T &value) {
+        _file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+        _size++;
+    }
+
+    void resize(Idx n) {
+        _file.resize(qint64(n)*sizeof(T));
+        _size = n;
+    }
+
+    // valid until the array is written to again
+    T *data() {
+        if(_size == 0) return nullptr;
+        _file.flush();
+        return reinterpret_cast<T*>(_file.map(0, qint64(_size)*sizeof(T)));
+    }
+
+private:
+    QTemporaryFile _file;
+    Idx _size = 0;
+};
+
+// reads an .obj a line at a time, triangulating polygons as fans; returns false if it can't be read, or
+// if a face uses a vertex that isn't defined before it (so that every corner handed on is in range)
+template<typename OnVertex, typename OnFace>
+static bool streamObj(const string &filePath, OnVertex onVertex, OnFace onFace) {
+    ifstream in(filePath);
+    if(!in) return false;
+
+    Idx n_vertices = 0;
+    size_t line_number = 0;
+    string line;
+    while(getline(in, line)) {
+        line_number++;
+        const char *s = line.c_str();
+        while(*s == ' ' || *s == '\t') s++;
+        if(s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            char *end;
+            Vector3f p;
+            p[0] = strtof(s+1, &end);
+            p[1] = strtof(end, &end);
+            p[2] = strtof(end, &end);
+            onVertex(p);
+            n_vertices++;
+        } else if(s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            // corners are "v", "v/vt", "v//vn" or "v/vt/vn", counted from 1 or back from the last vertex
+            int corners[3];
+            int n = 0;
+            s++;
+            while(true) {
+                char *end;
+                long i = strtol(s, &end, 10);
+                if(end == s) break;
+                s = end;
+                while(*s && *s != ' ' && *s != '\t') s++;
+                long corner = i < 0 ? long(n_vertices) + i : i - 1;
+                if(corner < 0 || corner >= long(n_vertices)) {
+                    cerr << "Face on line " << line_number << " uses vertex " << i << " of " << n_vertices << endl;
+                    return false;
+                }
+                if(n < 2) {
+                    corners[n++] = corner;
+                } else {
+                    corners[2] = corner;
+                    onFace(Vector3i(corners[0], corners[1], corners[2]));
+                    corners[1] = corner;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// interleaves the bits of a cell's coordinates, so that cells close in the order are close in space
+static uint32_t morton(const Vector3i &cell) {
+    uint32_t code = 0;
+    for(int bit = 0; bit < COUNT_BITS; bit++) {
+        for(int d = 0; d < 3; d++) code |= uint32_t((cell[d] >> bit) & 1) << (3*bit + d);
+    }
+    return code;
+}
+
+// the chunk's faces with their vertices renumbered from 0, and the global number of each vertex
+static void loadChunk(const Vector3i *faces, Idx n_faces, const Vector3f *positions,
+                      vector<Vector3f> &vertices, vector<Vector3i> &local_faces, vector<Idx> &global) {
+    vector<uint64_t> keys(3*n_faces);
+    vector<Idx> corners(3*n_faces);
+    Idx max_vertex = 0;
+    for(Idx i = 0; i < 3*n_faces; i++) {
+        keys[i] = faces[i/3][i%3];
+        corners[i] = i;
+        max_vertex = std::max<Idx>(max_vertex, keys[i]);
+    }
+    radixSort(keys, corners, std::bit_width(max_vertex));
+
+    vertices.clear();
+    global.clear();
+    local_faces.resize(n_faces);
+    for(Idx i = 0; i < 3*n_faces; i++) {
+        if(i == 0 || keys[i] != keys[i-1]) {
+            global.push_back(keys[i]);
+            vertices.push_back(positions[keys[i]]);
+        }
+        local_faces[corners[i]/3][corners[i]%3] = global.size()-1;
+    }
+}
+
+// closes each hole of the face list with a fan around a new vertex (whose global number is INVALID),
+// and returns the vertices that have to stay put for the chunk to still fit its neighbors. a vertex
+// where several wedges of faces meet at their tips (a chunk border passing through it twice, say) is
+// first split into one copy per wedge, so that each hole is a simple loop and the closed mesh is
+// manifold everywhere; the copies' neighbors stay put too, or a collapse could join two copies' rings
+static vector<Idx> closeHoles(vector<Vector3f> &vertices, vector<Vector3i> &faces, vector<Idx> &global) {
+    const Idx n_faces = faces.size();
+
+    // halfedge h goes from corner h to the next corner of face h/3, and twins have equal keys
+    auto nextCorner = [](Idx h) {return 3*(h/3) + (h%3+1)%3;};
+    vector<uint64_t> keys(3*n_faces);
+    vector<Idx> sorted(3*n_faces);
+    const int vertex_bits = std::bit_width(vertices.size());
+    for(Idx h = 0; h < 3*n_faces; h++) {
+        Idx a = faces[h/3][h%3], b = faces[h/3][(h%3+1)%3];
+        keys[h] = (uint64_t(std::min(a,b)) << vertex_bits) | std::max(a,b);
+        sorted[h] = h;
+    }
+    radixSort(keys, sorted, 2*vertex_bits);
+    auto paired = [&](Idx i) {
+        return (i > 0 && keys[i] == keys[i-1]) || (i+1 < 3*n_faces && keys[i] == keys[i+1]);
+    };
+
+    // corners of a vertex are in the same wedge when their faces share an edge at it
+    vector<Idx> parent(3*n_faces);
+    for(Idx c = 0; c < 3*n_faces; c++) parent[c] = c;
+    auto find = [&](Idx c) {
+        while(parent[c] != c) c = parent[c] = parent[parent[c]];
+        return c;
+    };
+    for(Idx i = 1; i < 3*n_faces; i++) {
+        if(keys[i] != keys[i-1]) continue;
+        Idx g = sorted[i-1], h = sorted[i];
+        parent[find(g)] = find(nextCorner(h));
+        parent[find(nextCorner(g))] = find(h);
+    }
+
+    vector<Idx> wedge(3*n_faces, INVALID);
+    vector<uint8_t> has_wedge(vertices.size(), false);
+    vector<Idx> split;
+    for(Idx c = 0; c < 3*n_faces; c++) {
+        Idx root = find(c);
+        Idx v = faces[c/3][c%3];
+        if(wedge[root] == INVALID) {
+            if(!has_wedge[v]) {
+                has_wedge[v] = true;
+                wedge[root] = v;
+            } else {
+                wedge[root] = vertices.size();
+                split.push_back(v);
+                split.push_back(vertices.size());
+                Vector3f p = vertices[v];
+                vertices.push_back(p);
+                global.push_back(global[v]);
+            }
+        }
+        faces[c/3][c%3] = wedge[root];
+    }
+    const Idx n_vertices = vertices.size();
+
+    vector<Idx> kept;
+    if(!split.empty()) {
+        vector<uint8_t> is_split(n_vertices, false);
+        for(Idx v : split) is_split[v] = true;
+        for(const Vector3i &face : faces) {
+            for(int i = 0; i < 3; i++) {
+                if(is_split[face[i]]) {
+                    kept.push_back(face[(i+1)%3]);
+                    kept.push_back(face[(i+2)%3]);
+                }
+            }
+        }
+    }
+
+    // the holes' edges, running opposite to the halfedges they face, grouped by where they start
+    vector<Idx> hole_from, hole_to;
+    vector<Idx> out_begin(n_vertices+1, 0);
+    for(Idx i = 0; i < 3*n_faces; i++) {
+        if(paired(i)) continue;
+        Idx h = sorted[i];
+        hole_from.push_back(faces[h/3][(h%3+1)%3]);
+        hole_to.push_back(faces[h/3][h%3]);
+        out_begin[hole_from.back()+1]++;
+    }
+    for(Idx v = 0; v < n_vertices; v++) out_begin[v+1] += out_begin[v];
+    vector<Idx> out(hole_from.size());
+    vector<Idx> cursor(out_begin.begin(), out_begin.end()-1);
+    for(Idx e = 0; e < hole_from.size(); e++) out[cursor[hole_from[e]]++] = e;
+    std::copy(out_begin.begin(), out_begin.end()-1, cursor.begin());
+
+    auto nextUnused = [&](Idx v) {
+        return cursor[v] < out_begin[v+1] ? out[cursor[v]++] : INVALID;
+    };
+
+    // walk the hole edges, cutting off a loop whenever the walk comes back to a vertex on its path
+    vector<Idx> on_path(n_vertices, INVALID);
+    vector<Idx> path;
+    auto closeLoop = [&](Idx first) {
+        Idx x = vertices.size();
+        Vector3f center = Vector3f::Zero();
+        for(Idx i = first; i < path.size(); i++) {
+            Idx e = path[i];
+            faces.emplace_back(hole_from[e], hole_to[e], x);
+            center += vertices[hole_from[e]];
+            kept.push_back(hole_from[e]);
+            on_path[hole_from[e]] = INVALID;
+        }
+        vertices.push_back(center / (path.size() - first));
+        global.push_back(INVALID);
+        path.resize(first);
+    };
+
+    for(Idx v = 0; v < n_vertices; v++) {
+        Idx e;
+        while((e = nextUnused(v)) != INVALID) {
+            path.assign(1, e);
+            on_path[v] = 0;
+            while(!path.empty()) {
+                Idx w = hole_to[path.back()];
+                if(on_path[w] != INVALID) {
+                    closeLoop(on_path[w]);
+                    if(path.empty()) break;
+                }
+                Idx next = nextUnused(w);
+                if(next == INVALID) {
+                    // only a non-manifold face list leaves a walk stuck open
+                    for(Idx e : path) on_path[hole_from[e]] = INVALID;
+                    path.clear();
+                    break;
+                }
+                on_path[w] = path.size();
+                path.push_back(next);
+            }
+        }
+    }
+
+    return kept;
+}
+
+void Mesh::outOfCoreSimplification(const string &filePath, int n, size_t memory_budget) {
+    // one pass over the text, keeping only the bounding box in memory
+    DiskArray<Vector3f> vertex_file;
+    DiskArray<Vector3i> face_file;
+    AlignedBox3f box;
+    bool read = streamObj(filePath,
+                          [&](const Vector3f &p) {vertex_file.push_back(p); box.extend(p);},
+                          [&](const Vector3i &face) {face_file.push_back(face);});
+    if(!read) {
+        cerr << "Failed to load/parse .obj file" << endl;
+        return;
+    }
+
+    const Idx n_faces = face_file.size();
+    const Idx n_vertices = vertex_file.size();
+    cout << "Streamed " << n_faces << " faces and " << n_vertices << " vertices" << endl;
+    if(n_faces == 0) return;
+    const Idx target_faces = n < int(n_faces) ? n_faces - std::max(n, 0) : 0;
+    const double ratio = double(target_faces) / n_faces;
+    const Idx capacity = std::max<size_t>(memory_budget / BYTES_PER_FACE, 1);
+
+    const Vector3f *positions = vertex_file.data();
+    const Vector3i *faces = face_file.data();
+
+    const int grid = 1 << COUNT_BITS;
+    Vector3f cell_size = (box.sizes() / grid).cwiseMax(std::numeric_limits<float>::min());
+    auto cellOf = [&](const Vector3i &face) -> uint32_t {
+        Vector3f centroid = (positions[face[0]] + positions[face[1]] + positions[face[2]]) / 3;
+        Vector3i cell = ((centroid - box.min()).cwiseQuotient(cell_size)).cast<int>();
+        return morton(cell.cwiseMax(0).cwiseMin(grid-1));
+    };
+
+    // cells in Morton order are grouped into chunks of at most `capacity` faces (unless one cell has more)
+    vector<Idx> cell_faces(grid*grid*grid, 0);
+    for(Idx f = 0; f < n_faces; f++) cell_faces[cellOf(faces[f])]++;
+
+    vector<Idx> cell_chunk(cell_faces.size());
+    vector<Idx> chunk_begin(1, 0);
+    Idx in_chunk = 0;
+    for(Idx c = 0; c < cell_faces.size(); c++) {
+        if(in_chunk > 0 && in_chunk + cell_faces[c] > capacity) {
+            chunk_begin.push_back(chunk_begin.back() + in_chunk);
+            in_chunk = 0;
+        }
+        cell_chunk[c] = chunk_begin.size()-1;
+        in_chunk += cell_faces[c];
+    }
+    chunk_begin.push_back(n_faces);
+    const Idx n_chunks = chunk_begin.size()-1;
+
+    // the faces again, chunk by chunk
+    DiskArray<Vector3i> chunked_file;
+    chunked_file.resize(n_faces);
+    Vector3i *chunked = chunked_file.data();
+    vector<Idx> cursor(chunk_begin.begin(), chunk_begin.end()-1);
+    for(Idx f = 0; f < n_faces; f++) {
+        chunked[cursor[cell_chunk[cellOf(faces[f])]]++] = faces[f];
+    }
+
+    // each chunk is simplified by itself with its border locked, so that the chunks still meet after,
+    // and appended to this mesh's face list, where the vertices on borders are shared by global number
+    _vertices.clear();
+    _faces.clear();
+    vector<uint8_t> seam;
+    unordered_map<Idx, Idx> seam_vertex;
+    Idx largest = 0;
+    for(Idx k = 0; k < n_chunks; k++) {
+        Idx begin = chunk_begin[k];
+        Idx count = chunk_begin[k+1] - begin;
+        if(count == 0) continue;
+        largest = std::max(largest, count);
+
+        Mesh chunk;
+        vector<Idx> global;
+        loadChunk(&chunked[begin], count, positions, chunk._vertices, chunk._faces, global);
+        vector<Idx> kept = closeHoles(chunk._vertices, chunk._faces, global);
+        chunk.buildHalfedges();
+        vector<Vector3f>().swap(chunk._vertices);
+        vector<Vector3i>().swap(chunk._faces);
+
+        // the fans' centers are locked too, so the fans are never touched
+        Property<uint8_t> locked = chunk.addVertexProperty<uint8_t>("locked");
+        for(Idx v : kept) locked[v] = true;
+        for(Idx v = 0; v < chunk.numVertexSlots(); v++) {
+            if(global[v] == INVALID) locked[v] = true;
+        }
+
+        SimplifyLimits limits;
+        limits.faces = Idx(std::ceil(count*ratio)) + (chunk.numFaces() - count);
+        chunk.quadricErrorSimplification(limits);
+
+        vector<Idx> index(chunk.numVertexSlots(), INVALID);
+        for(Idx f : chunk.faces()) {
+            Idx h = chunk.faceHalfedge(f);
+            Idx corners[3] = {chunk.vertex(h), chunk.vertex(chunk.next(h)), chunk.vertex(chunk.next(chunk.next(h)))};
+            if(global[corners[0]] == INVALID || global[corners[1]] == INVALID || global[corners[2]] == INVALID) continue;
+
+            Vector3i face;
+            for(int i = 0; i < 3; i++) {
+                Idx v = corners[i];
+                if(index[v] == INVALID) {
+                    if(locked[v]) {
+                        auto inserted = seam_vertex.try_emplace(global[v], _vertices.size());
+                        index[v] = inserted.first->second;
+                    } else {
+                        index[v] = _vertices.size();
+                    }
+                    if(index[v] == _vertices.size()) {
+                        _vertices.push_back(chunk.position(v));
+                        seam.push_back(locked[v]);
+                    }
+                }
+                face[i] = index[v];
+            }
+            _faces.push_back(face);
+        }
+    }
+    cout << "Simplified " << n_chunks << " chunks of up to " << largest << " faces" << endl;
+
+    // last, the seams: only edges among the seam vertices and their neighbors are collapsed
+    buildHalfedges();
+    Property<uint8_t> locked = addVertexProperty<uint8_t>("locked", true);
+    for(Idx v : vertices()) {
+        if(!seam[v]) continue;
+        locked[v] = false;
+        for(Idx h : outgoing(v)) locked[vertex(twin(h))] = false;
+    }
+    quadricErrorSimplification(SimplifyLimits{target_faces});
+    removeVertexProperty("locked");
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "mesh.h"
+
+// building blocks shared by the passes that rebuild whole arrays at once
+
+// stable LSD radix sort of values by key, each pass counting digits per block and scattering in parallel.
+// the blocks are a fixed split of the input handed out by `omp for`, so the result holds for any team size
+inline void radixSort(std::vector<uint64_t> &keys, std::vector<Idx> &values, int key_bits) {
+    const int digit_bits = 11;
+    const size_t n_buckets = size_t(1) << digit_bits;
+    const size_t n = keys.size();
+    const int n_blocks = omp_get_max_threads();
+
+    std::vector<uint64_t> keys_out(n);
+    std::vector<Idx> values_out(n);
+    std::vector<size_t> offsets(n_blocks * n_buckets);
+
+    for(int shift = 0; shift < key_bits; shift += digit_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        #pragma omp parallel
+        {
+            #pragma omp for schedule(static)
+            for(int b = 0; b < n_blocks; b++) {
+                size_t *offset = &offsets[b*n_buckets];
+                for(size_t i = n*b/n_blocks; i < n*(b+1)/n_blocks; i++) {
+                    offset[(keys[i] >> shift) & (n_buckets-1)]++;
+                }
+            }
+
+            #pragma omp single
+            {
+                // bucket-major, then block-major, so equal digits keep their order
+                size_t sum = 0;
+                for(size_t d = 0; d < n_buckets; d++) {
+                    for(int b = 0; b < n_blocks; b++) {
+                        size_t count = offsets[b*n_buckets + d];
+                        offsets[b*n_buckets + d] = sum;
+                        sum += count;
+                    }
+                }
+            }
+
+            #pragma omp for schedule(static)
+            for(int b = 0; b < n_blocks; b++) {
+                size_t *offset = &offsets[b*n_buckets];
+                for(size_t i = n*b/n_blocks; i < n*(b+1)/n_blocks; i++) {
+                    size_t &o = offset[(keys[i] >> shift) & (n_buckets-1)];
+                    keys_out[o] = keys[i];
+                    values_out[o] = values[i];
+                    o++;
+                }
+            }
+        }
+
+        keys.swap(keys_out);
+        values.swap(values_out);
+    }
+}
+
+// numbers the slots i < n for which keep(i) holds in order, writing INVALID for the rest, and returns how many were kept
+// (counted and numbered per block, as in radixSort)
+template<typename Keep>
+Idx compactIndices(Idx n, Keep keep, std::vector<Idx> &index) {
+    const int n_blocks = omp_get_max_threads();
+    std::vector<Idx> offsets(n_blocks+1, 0);
+    index.resize(n);
+    auto blockBegin = [&](int b) {return Idx(uint64_t(n)*b/n_blocks);};
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static)
+        for(int b = 0; b < n_blocks; b++) {
+            Idx count = 0;
+            for(Idx i = blockBegin(b); i < blockBegin(b+1); i++) {
+                if(keep(i)) count++;
+            }
+            offsets[b+1] = count;
+        }
+
+        #pragma omp single
+        for(int b = 0; b < n_blocks; b++) offsets[b+1] += offsets[b];
+
+        #pragma omp for schedule(static)
+        for(int b = 0; b < n_blocks; b++) {
+            Idx next = offsets[b];
+            for(Idx i = blockBegin(b); i < blockBegin(b+1); i++) {
+                index[i] = keep(i) ? next++ : INVALID;
+            }
+        }
+    }
+
+    return offsets[n_blocks];
+}
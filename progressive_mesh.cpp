@@ -0,0 +1,205 @@
+#include "progressive_mesh.h"
+
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+using namespace Eigen;
+using namespace std;
+
+static Vector3i faceCorners(const Mesh &mesh, Idx f) {
+    if(mesh.faceDeleted(f)) return Vector3i(-1, -1, -1);
+    Idx h = mesh.faceHalfedge(f);
+    return Vector3i(mesh.vertex(h), mesh.vertex(mesh.next(h)), mesh.vertex(mesh.next(mesh.next(h))));
+}
+
+void ProgressiveMesh::start(const Mesh &mesh) {
+    _positions.resize(mesh.numVertexSlots());
+    for(Idx v : mesh.vertices()) {
+        _positions[v] = mesh.position(v);
+    }
+    _faces.resize(mesh.numFaceSlots());
+    for(Idx f = 0; f < mesh.numFaceSlots(); f++) {
+        _faces[f] = faceCorners(mesh, f);
+    }
+    _n_faces_start = mesh.numFaces();
+
+    _collapses.clear();
+    _changes.clear();
+    _level = 0;
+}
+
+void ProgressiveMesh::beginCollapse(const Mesh &mesh, Idx halfedge, float error) {
+    assert(_level == _collapses.size());
+    Collapse collapse{};
+    collapse.kept = mesh.vertex(halfedge);
+    collapse.removed = mesh.vertex(mesh.twin(halfedge));
+    collapse.first_change = _changes.size();
+    collapse.error = error;
+    collapse.kept_before = mesh.position(collapse.kept);
+    collapse.kept_after = collapse.kept_before; // until endCollapse
+
+    // the faces around the removed vertex are the only ones that get deleted or rewired
+    for(Idx h : mesh.outgoing(collapse.removed)) {
+        Idx f = mesh.face(h);
+        _changes.push_back({f, faceCorners(mesh, f), Vector3i(-1, -1, -1)});
+    }
+    _collapses.push_back(collapse);
+}
+
+void ProgressiveMesh::endCollapse(const Mesh &mesh) {
+    Collapse &collapse = _collapses.back();
+    collapse.kept_after = mesh.position(collapse.kept);
+    collapse.n_faces = mesh.numFaces();
+    for(Idx i = collapse.first_change; i < _changes.size(); i++) {
+        _changes[i].after = faceCorners(mesh, _changes[i].face);
+        _faces[_changes[i].face] = _changes[i].after;
+    }
+    _positions[collapse.kept] = collapse.kept_after;
+    _level++;
+}
+
+Idx ProgressiveMesh::changesEnd(Idx collapse) const {
+    return collapse+1 < _collapses.size() ? _collapses[collapse+1].first_change : _changes.size();
+}
+
+Idx ProgressiveMesh::numFaces() const {
+    return _level == 0 ? _n_faces_start : _collapses[_level-1].n_faces;
+}
+
+void ProgressiveMesh::setLevel(Idx level) {
+    level = min(level, numCollapses());
+    while(_level < level) {
+        const Collapse &collapse = _collapses[_level];
+        for(Idx i = collapse.first_change; i < changesEnd(_level); i++) {
+            _faces[_changes[i].face] = _changes[i].after;
+        }
+        _positions[collapse.kept] = collapse.kept_after;
+        _level++;
+    }
+    while(_level > level) {
+        _level--;
+        const Collapse &collapse = _collapses[_level];
+        for(Idx i = collapse.first_change; i < changesEnd(_level); i++) {
+            _faces[_changes[i].face] = _changes[i].before;
+        }
+        _positions[collapse.kept] = collapse.kept_before;
+    }
+}
+
+Idx ProgressiveMesh::levelForFaces(Idx n) const {
+    if(_n_faces_start <= n) return 0;
+    // face counts only go down
+    auto it = partition_point(_collapses.begin(), _collapses.end(), [&](const Collapse &collapse) {return collapse.n_faces > n;});
+    return min<Idx>(it - _collapses.begin() + 1, numCollapses());
+}
+
+Idx ProgressiveMesh::levelForError(float error) const {
+    Idx level = 0;
+    while(level < numCollapses() && _collapses[level].error <= error) level++;
+    return level;
+}
+
+void ProgressiveMesh::toVectors(vector<Vector3f> &vertices, vector<Vector3i> &faces) const {
+    // vertices keep their relative order
+    vector<int> index(_positions.size(), -1);
+    for(const Vector3i &face : _faces) {
+        if(face[0] < 0) continue;
+        for(int i = 0; i < 3; i++) index[face[i]] = 0;
+    }
+
+    vertices.clear();
+    for(Idx v = 0; v < _positions.size(); v++) {
+        if(index[v] < 0) continue;
+        index[v] = vertices.size();
+        vertices.push_back(_positions[v]);
+    }
+
+    faces.clear();
+    for(const Vector3i &face : _faces) {
+        if(face[0] < 0) continue;
+        faces.emplace_back(index[face[0]], index[face[1]], index[face[2]]);
+    }
+}
+
+// binary: a header, then the arrays as they are in memory
+static const char MAGIC[4] = {'P', 'M', 'S', 'H'};
+
+template<typename T>
+static void writeArray(ofstream &out, const vector<T> &array) {
+    Idx n = array.size();
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    out.write(reinterpret_cast<const char*>(array.data()), n*sizeof(T));
+}
+
+template<typename T>
+static bool readArray(ifstream &in, vector<T> &array) {
+    Idx n = 0;
+    in.read(reinterpret_cast<char*>(&n), sizeof(n));
+    if(!in) return false;
+
+    // a count past the end of the file is a truncated or foreign one, not worth allocating for
+    streampos here = in.tellg();
+    in.seekg(0, ios::end);
+    streamoff left = in.tellg() - here;
+    in.seekg(here);
+    if(uint64_t(left) < uint64_t(n)*sizeof(T)) return false;
+
+    array.resize(n);
+    in.read(reinterpret_cast<char*>(array.data()), n*sizeof(T));
+    return bool(in);
+}
+
+void ProgressiveMesh::save(const string &filePath) const {
+    ofstream out(filePath, ios::binary);
+    out.write(MAGIC, sizeof(MAGIC));
+    out.write(reinterpret_cast<const char*>(&_n_faces_start), sizeof(_n_faces_start));
+    out.write(reinterpret_cast<const char*>(&_level), sizeof(_level));
+    writeArray(out, _positions);
+    writeArray(out, _faces);
+    writeArray(out, _collapses);
+    writeArray(out, _changes);
+}
+
+// the corners of a face, all -1 or all one of the n vertices
+static bool validCorners(const Vector3i &corners, Idx n) {
+    if(corners == Vector3i(-1, -1, -1)) return true;
+    return corners.minCoeff() >= 0 && Idx(corners.maxCoeff()) < n;
+}
+
+// every id that setLevel and toVectors index with is in range of the arrays read
+bool ProgressiveMesh::valid() const {
+    if(_level > _collapses.size()) return false;
+    for(const Vector3i &face : _faces) {
+        if(!validCorners(face, _positions.size())) return false;
+    }
+    for(const FaceChange &change : _changes) {
+        if(change.face >= _faces.size() || !validCorners(change.before, _positions.size())
+                                        || !validCorners(change.after, _positions.size())) return false;
+    }
+    Idx first_change = 0;
+    for(const Collapse &collapse : _collapses) {
+        if(collapse.kept >= _positions.size() || collapse.removed >= _positions.size()) return false;
+        // each collapse's changes start where the previous one's do or later, and within _changes
+        if(collapse.first_change < first_change || collapse.first_change > _changes.size()) return false;
+        first_change = collapse.first_change;
+    }
+    return true;
+}
+
+bool ProgressiveMesh::load(const string &filePath) {
+    ifstream in(filePath, ios::binary);
+    char magic[sizeof(MAGIC)];
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&_n_faces_start), sizeof(_n_faces_start));
+    in.read(reinterpret_cast<char*>(&_level), sizeof(_level));
+    if(!in || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+           || !readArray(in, _positions) || !readArray(in, _faces)
+           || !readArray(in, _collapses) || !readArray(in, _changes) || !valid()) {
+        cerr << "Failed to load/parse progressive mesh file" << endl;
+        *this = ProgressiveMesh();
+        return false;
+    }
+    return true;
+}
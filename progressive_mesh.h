@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "mesh.h"
+
+// a mesh together with the edge collapses that simplified it, which can be undone and redone
+// to get any level of detail in time proportional to the number of collapses in between.
+// vertices and faces keep the ids they had in the mesh that was simplified
+class ProgressiveMesh
+{
+public:
+    // starts recording from the mesh as it is now
+    void start(const Mesh &mesh);
+
+    // called around each collapse of the halfedge, which keeps vertex(halfedge)
+    void beginCollapse(const Mesh &mesh, Idx halfedge, float error);
+    void endCollapse(const Mesh &mesh);
+
+    void save(const std::string &filePath) const;
+    // false, leaving it empty, for a missing or truncated file or one whose ids fall outside its arrays
+    bool load(const std::string &filePath);
+
+    Idx numCollapses() const {return _collapses.size();}
+    Idx level() const {return _level;} // number of collapses applied
+    Idx numFaces() const;
+
+    // undoes or redoes collapses until `level` of them are applied
+    void setLevel(Idx level);
+
+    // the fewest collapses that get down to n faces (or all of them)
+    Idx levelForFaces(Idx n) const;
+    // the most collapses that each cost at most `error`
+    Idx levelForError(float error) const;
+
+    // the current level as a plain face list, unused vertices dropped
+    void toVectors(std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3i> &faces) const;
+
+private:
+    // a face's corners before and after a collapse, -1 when it doesn't exist
+    struct FaceChange
+    {
+        Idx face;
+        Eigen::Vector3i before;
+        Eigen::Vector3i after;
+    };
+
+    struct Collapse
+    {
+        Idx kept;
+        Idx removed;
+        Idx first_change; // into _changes, up to the next collapse's
+        Idx n_faces; // after this collapse
+        float error;
+        Eigen::Vector3f kept_before;
+        Eigen::Vector3f kept_after;
+    };
+
+    // current positions and corners by id
+    std::vector<Eigen::Vector3f> _positions;
+    std::vector<Eigen::Vector3i> _faces;
+    Idx _n_faces_start = 0;
+
+    std::vector<Collapse> _collapses;
+    std::vector<FaceChange> _changes;
+    Idx _level = 0;
+
+    Idx changesEnd(Idx collapse) const;
+    // whether a loaded file's ids all fit its arrays
+    bool valid() const;
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+
+typedef std::uint32_t Idx;
+
+// the default value of a new property: T() leaves Eigen's fixed-size types uninitialized, so those start at zero
+template<typename T>
+T zeroValue() {
+    if constexpr (requires {T::Zero();}) return T::Zero();
+    else return T{};
+}
+
+// one value per element slot, kept the same size as the element array it belongs to
+class BasePropertyArray
+{
+public:
+    virtual ~BasePropertyArray() {}
+
+    virtual void resize(Idx n) = 0;
+    virtual void reserve(Idx n) = 0;
+    virtual void reset(Idx i) = 0;
+};
+
+template<typename T>
+class PropertyArray : public BasePropertyArray
+{
+public:
+    PropertyArray(Idx n, const T &value) : data(n, value), value(value) {}
+
+    void resize(Idx n) override {data.resize(n, value);}
+    void reserve(Idx n) override {data.reserve(n);}
+    void reset(Idx i) override {data[i] = value;}
+
+    std::vector<T> data;
+    T value; // given to new elements
+};
+
+// handle to a property, indexed by element like the mesh's own arrays;
+// stays valid while the elements are split, collapsed or added, until the property is removed
+template<typename T>
+class Property
+{
+public:
+    Property() : _array(nullptr) {}
+    explicit Property(PropertyArray<T> *array) : _array(array) {}
+
+    T &operator[](Idx i) {return _array->data[i];}
+    const T &operator[](Idx i) const {return _array->data[i];}
+
+    explicit operator bool() const {return _array != nullptr;}
+
+private:
+    PropertyArray<T> *_array;
+};
+
+// the named properties of one kind of element
+class PropertyContainer
+{
+public:
+    template<typename T>
+    Property<T> add(const std::string &name, const T &value = zeroValue<T>()) {
+        static_assert(!std::is_same_v<T, bool>, "use std::uint8_t, std::vector<bool> elements can't be referenced");
+        assert(!_properties.contains(name));
+        PropertyArray<T> *array = new PropertyArray<T>(_size, value);
+        _properties[name].reset(array);
+        return Property<T>(array);
+    }
+
+    // an empty handle if there is no such property (or it has another type)
+    template<typename T>
+    Property<T> get(const std::string &name) {
+        auto it = _properties.find(name);
+        if(it == _properties.end()) return Property<T>();
+        return Property<T>(dynamic_cast<PropertyArray<T>*>(it->second.get()));
+    }
+
+    void remove(const std::string &name) {_properties.erase(name);}
+
+    void resize(Idx n) {
+        _size = n;
+        for(auto &pair : _properties) pair.second->resize(n);
+    }
+
+    void reserve(Idx n) {
+        for(auto &pair : _properties) pair.second->reserve(n);
+    }
+
+    // back to the default value, for a slot that is being reused
+    void reset(Idx i) {
+        for(auto &pair : _properties) pair.second->reset(i);
+    }
+
+private:
+    Idx _size = 0;
+    std::map<std::string, std::unique_ptr<BasePropertyArray>> _properties;
+};
@@ -0,0 +1,70 @@
+#include "quadric.h"
+#include <algorithm>
+
+// below this, det(A)/trace(A)^3 counts as singular: A is positive semidefinite,
+// so this is roughly the ratio of its smallest eigenvalue to its largest
+constexpr double SINGULAR = 1e-9;
+
+// quadrics solved side by side, one per SIMD lane
+constexpr int LANES = 4;
+typedef Eigen::Array<double, LANES, 1> Lanes;
+
+void optimal_positions(std::size_t n, const Quadric *q, const Eigen::Vector3f *a, const Eigen::Vector3f *b,
+                       float *error, Eigen::Vector3f *position) {
+    for(std::size_t start = 0; start < n; start += LANES) {
+        // transpose into lanes, repeating the last quadric to fill the final block
+        Lanes c[Quadric::N], p[3], e[3];
+        for(int l = 0; l < LANES; l++) {
+            std::size_t i = std::min(start+l, n-1);
+            for(int k = 0; k < Quadric::N; k++) c[k][l] = q[i].q[k];
+            for(int d = 0; d < 3; d++) {
+                p[d][l] = a[i][d];
+                e[d][l] = b[i][d] - a[i][d];
+            }
+        }
+        const Lanes &a2 = c[Quadric::A2], &ab = c[Quadric::AB], &ac = c[Quadric::AC], &ad = c[Quadric::AD];
+        const Lanes &b2 = c[Quadric::B2], &bc = c[Quadric::BC], &bd = c[Quadric::BD];
+        const Lanes &c2 = c[Quadric::C2], &cd = c[Quadric::CD];
+        const Lanes &d2 = c[Quadric::D2];
+
+        // A x = -b by Cramer's rule, with the cofactors of the symmetric A
+        Lanes m00 = b2*c2 - bc*bc;
+        Lanes m01 = ac*bc - ab*c2;
+        Lanes m02 = ab*bc - ac*b2;
+        Lanes m11 = a2*c2 - ac*ac;
+        Lanes m12 = ab*ac - a2*bc;
+        Lanes m22 = a2*b2 - ab*ab;
+        Lanes det = a2*m00 + ab*m01 + ac*m02;
+        Lanes trace = a2 + b2 + c2;
+        Lanes inv_det = det.inverse();
+        Lanes s0 = -(m00*ad + m01*bd + m02*cd)*inv_det;
+        Lanes s1 = -(m01*ad + m11*bd + m12*cd)*inv_det;
+        Lanes s2 = -(m02*ad + m12*bd + m22*cd)*inv_det;
+
+        // otherwise the minimum of the quadratic along the edge, p + t e, clamped to it
+        Lanes g0 = a2*p[0] + ab*p[1] + ac*p[2] + ad;
+        Lanes g1 = ab*p[0] + b2*p[1] + bc*p[2] + bd;
+        Lanes g2 = ac*p[0] + bc*p[1] + c2*p[2] + cd;
+        Lanes curvature = e[0]*(a2*e[0] + ab*e[1] + ac*e[2])
+                        + e[1]*(ab*e[0] + b2*e[1] + bc*e[2])
+                        + e[2]*(ac*e[0] + bc*e[1] + c2*e[2]);
+        Lanes slope = e[0]*g0 + e[1]*g1 + e[2]*g2;
+        Lanes t = (curvature > 0).select(-slope/curvature, Lanes::Constant(0.5)).max(0.0).min(1.0);
+
+        // both are computed (dividing by zero for some lanes) and each lane picks one
+        Eigen::Array<bool, LANES, 1> solvable = det.abs() > SINGULAR*trace*trace*trace;
+        Lanes x0 = solvable.select(s0, p[0] + t*e[0]);
+        Lanes x1 = solvable.select(s1, p[1] + t*e[1]);
+        Lanes x2 = solvable.select(s2, p[2] + t*e[2]);
+
+        Lanes err = x0*(a2*x0 + 2*(ab*x1 + ac*x2 + ad))
+                  + x1*(b2*x1 + 2*(bc*x2 + bd))
+                  + x2*(c2*x2 + 2*cd)
+                  + d2;
+
+        for(int l = 0; l < LANES && start+l < n; l++) {
+            error[start+l] = err[l];
+            position[start+l] = Eigen::Vector3f(x0[l], x1[l], x2[l]);
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+#include "Eigen/Dense"
+
+// symmetric 4x4 error quadric, stored as its upper triangle
+//     a2 ab ac ad
+//        b2 bc bd
+//           c2 cd
+//              d2
+// in double precision, since the d terms get large for meshes far from the origin
+struct Quadric
+{
+    enum {A2, AB, AC, AD, B2, BC, BD, C2, CD, D2, N};
+    double q[N];
+
+    Quadric() {for(int i = 0; i < N; i++) q[i] = 0;}
+
+    // squared distance to the plane n.x + d = 0
+    static Quadric plane(const Eigen::Vector3d &n, double d) {
+        Quadric result;
+        result.q[A2] = n[0]*n[0]; result.q[AB] = n[0]*n[1]; result.q[AC] = n[0]*n[2]; result.q[AD] = n[0]*d;
+        result.q[B2] = n[1]*n[1]; result.q[BC] = n[1]*n[2]; result.q[BD] = n[1]*d;
+        result.q[C2] = n[2]*n[2]; result.q[CD] = n[2]*d;
+        result.q[D2] = d*d;
+        return result;
+    }
+
+    Quadric &operator+=(const Quadric &other) {
+        for(int i = 0; i < N; i++) q[i] += other.q[i];
+        return *this;
+    }
+
+    Quadric operator+(const Quadric &other) const {
+        Quadric result = *this;
+        return result += other;
+    }
+
+    // [x 1] Q [x 1]^T
+    double operator()(const Eigen::Vector3d &x) const {
+        return x[0]*(q[A2]*x[0] + 2*(q[AB]*x[1] + q[AC]*x[2] + q[AD]))
+             + x[1]*(q[B2]*x[1] + 2*(q[BC]*x[2] + q[BD]))
+             + x[2]*(q[C2]*x[2] + 2*q[CD])
+             + q[D2];
+    }
+
+    // the minimum is where A x = -b, with A the upper left 3x3 block and b the last column
+    Eigen::Matrix3d A() const {
+        Eigen::Matrix3d a;
+        a << q[A2], q[AB], q[AC],
+             q[AB], q[B2], q[BC],
+             q[AC], q[BC], q[C2];
+        return a;
+    }
+
+    Eigen::Vector3d b() const {return Eigen::Vector3d(q[AD], q[BD], q[CD]);}
+};
+
+// the point minimizing each quadric, or the best point on its edge a-b when the quadric has no
+// well-defined minimum (flat or creased surroundings); independent across i, so the loop vectorizes
+void optimal_positions(std::size_t n, const Quadric *q, const Eigen::Vector3f *a, const Eigen::Vector3f *b,
+                       float *error, Eigen::Vector3f *position);
+
+inline std::pair<float, Eigen::Vector3f> optimal_position(const Quadric &q, const Eigen::Vector3f &a, const Eigen::Vector3f &b) {
+    std::pair<float, Eigen::Vector3f> result;
+    optimal_positions(1, &q, &a, &b, &result.first, &result.second);
+    return result;
+}
@@ -1,199 +1,599 @@
 #include "mesh.h"
-#include <map>
-#include <unordered_set>
+#include "indexed_heap.h"
+#include "quadric.h"
+#include "progressive_mesh.h"
+#include <algorithm>
+#include <cmath>
 #include <cassert>
+#include <random>
 
-bool canCollapseEdge(Halfedge *halfedge) {
-    Halfedge *twin = halfedge->twin;
+Eigen::Vector3d computeNormal(Eigen::Vector3d a, Eigen::Vector3d b, Eigen::Vector3d c) {
+    Eigen::Vector3d AB = b-a;
+    Eigen::Vector3d AC = c-a;
+    return AB.cross(AC).normalized();
+}
+
+// error of collapsing the edge and where the kept vertex should go
+std::pair<float, Eigen::Vector3f> collapseCost(const Mesh &mesh, Idx h, Property<Quadric> vertex_q) {
+    Idx a = mesh.vertex(h);
+    Idx b = mesh.vertex(mesh.twin(h));
+    return optimal_position(vertex_q[a]+vertex_q[b], mesh.position(a), mesh.position(b));
+}
+
+// collapseCost for many edges, solved a block at a time
+void collapseCosts(const Mesh &mesh, const std::vector<Idx> &edges, Property<Quadric> vertex_q, std::vector<float> &costs, Property<Eigen::Vector3f> targets) {
+    constexpr Idx BLOCK = 256;
+    costs.resize(edges.size());
+    Idx n_blocks = (edges.size() + BLOCK-1)/BLOCK;
+    #pragma omp parallel for schedule(static)
+    for(Idx block = 0; block < n_blocks; block++) {
+        Idx start = block*BLOCK;
+        Idx n = std::min<Idx>(BLOCK, edges.size() - start);
+        Quadric q[BLOCK];
+        Eigen::Vector3f a[BLOCK], b[BLOCK], positions[BLOCK];
+        for(Idx i = 0; i < n; i++) {
+            Idx h = mesh.edgeHalfedge(edges[start+i]);
+            Idx va = mesh.vertex(h);
+            Idx vb = mesh.vertex(mesh.twin(h));
+            q[i] = vertex_q[va] + vertex_q[vb];
+            a[i] = mesh.position(va);
+            b[i] = mesh.position(vb);
+        }
+        optimal_positions(n, q, a, b, &costs[start], positions);
+        for(Idx i = 0; i < n; i++) {
+            targets[edges[start+i]] = positions[i];
+        }
+    }
+}
 
-    std::unordered_set<Vertex*> hset;
-    std::unordered_set<Vertex*> tset;
+// canCollapse, and neither end is locked (if the mesh has a "locked" vertex property)
+bool canCollapseUnlocked(const Mesh &mesh, Idx h, Property<std::uint8_t> locked) {
+    if(locked && (locked[mesh.vertex(h)] || locked[mesh.vertex(mesh.twin(h))])) return false;
+    return mesh.canCollapse(h);
+}
 
-    Halfedge *h = halfedge;
-    do {
-        hset.insert(h->twin->vertex);
-        h = h->twin->next;
+// (re)queues the edge by the error of collapsing it, or drops it if it can't be collapsed
+void updateEdge(const Mesh &mesh, Idx h, IndexedHeap &pq, Property<Eigen::Vector3f> targets, Property<Quadric> vertex_q,
+                Property<std::uint8_t> locked = Property<std::uint8_t>()) {
+    Idx e = mesh.edge(h);
+    if(canCollapseUnlocked(mesh, h, locked)) {
+        auto updated_error = collapseCost(mesh, h, vertex_q);
+        targets[e] = updated_error.second;
+        pq.update(e, updated_error.first);
+    } else {
+        pq.remove(e);
     }
-    while(h != halfedge);
+}
 
-    h = twin;
-    do {
-        tset.insert(h->twin->vertex);
-        h = h->twin->next;
+// queues every collapsible edge, with all the costs solved together
+void queueCollapsible(const Mesh &mesh, Property<Quadric> vertex_q, Property<Eigen::Vector3f> targets, IndexedHeap &pq,
+                      Property<std::uint8_t> locked = Property<std::uint8_t>()) {
+    Idx n_edge_slots = mesh.numEdgeSlots();
+    std::vector<std::uint8_t> collapsible(n_edge_slots, false);
+    #pragma omp parallel for schedule(static)
+    for(Idx e = 0; e < n_edge_slots; e++) {
+        collapsible[e] = !mesh.edgeDeleted(e) && canCollapseUnlocked(mesh, mesh.edgeHalfedge(e), locked);
     }
-    while(h != twin);
 
-    for(Vertex* v : hset) {
-        if(tset.contains(v) && degree(v) <= 3) return false;
+    std::vector<Idx> queued;
+    queued.reserve(mesh.numEdges());
+    for(Idx e = 0; e < n_edge_slots; e++) {
+        if(collapsible[e]) queued.push_back(e);
     }
 
-    return true;
+    std::vector<float> costs;
+    collapseCosts(mesh, queued, vertex_q, costs, targets);
+    pq.reserve(queued.size());
+    for(Idx i = 0; i < queued.size(); i++) {
+        pq.append(queued[i], costs[i]);
+    }
+    pq.heapify();
 }
 
-Eigen::Vector3f computeNormal(Eigen::Vector3f a, Eigen::Vector3f b, Eigen::Vector3f c) {
-    Eigen::Vector3f AB = b-a;
-    Eigen::Vector3f AC = c-a;
-    return AB.cross(AC).normalized();
+void recheckCanCollapse(const Mesh &mesh, Idx v, IndexedHeap &pq, Property<Eigen::Vector3f> targets, Property<Quadric> vertex_q,
+                        Property<std::uint8_t> locked = Property<std::uint8_t>()) {
+    for(Idx h : mesh.outgoing(v)) {
+        updateEdge(mesh, mesh.next(h), pq, targets, vertex_q, locked);
+    }
 }
 
-std::pair<float, Eigen::Vector3f> linear_search(Eigen::Matrix4f q, Eigen::Vector3f a, Eigen::Vector3f b) {
-    float best_error = std::numeric_limits<float>::infinity();
-    Eigen::Vector3f best_point = a;
-    int num_points = 10;
-    Eigen::Vector3f step = (b-a)/num_points;
-    for(int i = 0; i<= num_points; i++) {
-        Eigen::Vector4f point;
-        point << a + step*i, 1;
-        float error = point.transpose() * q * point;
-        if(error < best_error) {
-            best_error = error;
-            best_point = point.head<3>();
+Eigen::Vector3d faceNormal(const Mesh &mesh, Idx f) {
+    Idx h = mesh.faceHalfedge(f);
+    return computeNormal(mesh.position(mesh.vertex(h)).cast<double>(), mesh.position(mesh.vertex(mesh.next(h))).cast<double>(), mesh.position(mesh.vertex(mesh.next(mesh.next(h)))).cast<double>());
+}
+
+// the unit normal of each face, as the "qem:normal" face property
+Property<Eigen::Vector3d> computeFaceNormals(Mesh &mesh) {
+    Property<Eigen::Vector3d> normals = mesh.addFaceProperty<Eigen::Vector3d>("qem:normal");
+    for(Idx f : mesh.faces()) {
+        normals[f] = faceNormal(mesh, f);
+    }
+    return normals;
+}
+
+// the fundamental error quadric of each vertex, summed over its faces' planes
+// (from the face normals computed before, if there are any)
+Property<Quadric> computeQuadrics(Mesh &mesh) {
+    Property<Eigen::Vector3d> normals = mesh.getFaceProperty<Eigen::Vector3d>("qem:normal");
+    if(!normals) normals = computeFaceNormals(mesh);
+
+    // for each vertex in mesh, compute Q
+    Property<Quadric> vertex_q = mesh.addVertexProperty<Quadric>("qem:q");
+    for(Idx v : mesh.vertices()) {
+        Quadric q;
+        Eigen::Vector3d p = mesh.position(v).cast<double>();
+        for(Idx h : mesh.outgoing(v)) {
+            Eigen::Vector3d normal = normals[mesh.face(h)];
+            q += Quadric::plane(normal, -p.dot(normal));
         }
+        vertex_q[v] = q;
     }
-    return std::make_pair(best_error, best_point);
+
+    mesh.removeFaceProperty("qem:normal");
+    return vertex_q;
 }
 
-std::pair<float, Eigen::Vector3f> optimal_position(Eigen::Matrix4f q, Eigen::Vector3f a, Eigen::Vector3f b) {
-    Eigen::Matrix4f mat_to_invert;
-    mat_to_invert << q(0,0), q(0,1), q(0,2), q(0,3),
-                     q(0,1), q(1,1), q(1,2), q(1,3),
-                     q(0,2), q(1,2), q(2,2), q(2,3),
-                     0,      0,      0,      1;
-    if(mat_to_invert.determinant() == 0) {
-        return linear_search(q, a, b);
+// the face count n faces below the current one
+Idx facesAfterRemoving(const Mesh &mesh, int n) {
+    return n < int(mesh.numFaces()) ? mesh.numFaces() - std::max(n, 0) : 0;
+}
+
+void Mesh::quadricErrorSimplification(int n, ProgressiveMesh *record) {
+    SimplifyLimits limits;
+    limits.faces = facesAfterRemoving(*this, n);
+    quadricErrorSimplification(limits, record);
+}
+
+// collapsing the halfedge's vertex into the other end leaves the surface in place when the other end lies
+// within max_offset of the planes of all the faces around the vertex, and no face turns by more than
+// PLANAR_NORMAL (a cosine); that is the case inside flat regions and along straight creases
+constexpr double PLANAR_NORMAL = 0.999;
+
+bool planarCollapse(const Mesh &mesh, Idx h, Property<Eigen::Vector3d> normals, double max_offset) {
+    Eigen::Vector3d from = mesh.position(mesh.vertex(h)).cast<double>();
+    Eigen::Vector3d to = mesh.position(mesh.vertex(mesh.twin(h))).cast<double>();
+    Eigen::Vector3d edge = to - from;
+    for(Idx g : mesh.outgoing(mesh.vertex(h))) {
+        Idx f = mesh.face(g);
+        if(std::abs(normals[f].dot(edge)) > max_offset) return false;
+
+        // the two faces on the edge go, the others get the other end as a corner
+        if(g == h || g == mesh.next(mesh.twin(h))) continue;
+        Idx a = mesh.vertex(mesh.next(g)), b = mesh.vertex(mesh.next(mesh.next(g)));
+        Eigen::Vector3d moved = computeNormal(to, mesh.position(a).cast<double>(), mesh.position(b).cast<double>());
+        if(moved.dot(normals[f]) < PLANAR_NORMAL) return false;
     }
+    return true;
+}
 
-    Eigen::Vector4f point = mat_to_invert.inverse() * Eigen::Vector4f(0,0,0,1);
-    float error = point.transpose() * q * point;
-    return std::make_pair(error, point.head<3>());
+// sweeps over the vertices, collapsing each one into a neighbor where that's exact, until a sweep
+// finds none; flat regions are left with only their corners, without a heap pop per collapse
+void Mesh::collapsePlanarVertices(Idx target_faces, Idx min_vertices, double max_offset, ProgressiveMesh *record) {
+    Property<Eigen::Vector3d> normals = getFaceProperty<Eigen::Vector3d>("qem:normal");
+    Property<std::uint8_t> locked = getVertexProperty<std::uint8_t>("locked");
+
+    bool collapsed = true;
+    while(collapsed) {
+        collapsed = false;
+        for(Idx v : vertices()) {
+            if(numFaces() <= target_faces || numVertices() <= min_vertices) return;
+            if(locked && locked[v]) continue;
+
+            for(Idx h : outgoing(v)) {
+                // the other end stays where it is, so it may be locked
+                Idx kept = twin(h);
+                if(!planarCollapse(*this, h, normals, max_offset) || !canCollapse(kept)) continue;
+
+                if(record) record->beginCollapse(*this, kept, 0);
+                Idx w = vertex(kept);
+                Eigen::Vector3f p = position(w);
+                collapse(kept, _free);
+                position(w) = p;
+                if(record) record->endCollapse(*this);
+
+                for(Idx g : outgoing(w)) {
+                    normals[face(g)] = faceNormal(*this, face(g));
+                }
+                collapsed = true;
+                break;
+            }
+        }
+    }
 }
 
-void updateEdge(Halfedge *h, std::multimap<float, std::pair<Edge*, Eigen::Vector3f>> &pq, std::unordered_map<Edge*, std::_Rb_tree_iterator<std::pair<const float, std::pair<Edge*, Eigen::Vector3f>>>> &edge_iterators, std::unordered_map<Vertex*, Eigen::Matrix4f> &vertex_q) {
-    if(canCollapseEdge(h)) {
-        auto updated_error = optimal_position(vertex_q[h->vertex]+vertex_q[h->twin->vertex], h->vertex->pos, h->twin->vertex->pos);
-        if(edge_iterators.contains(h->edge)) pq.erase(edge_iterators[h->edge]);
-        auto it = pq.insert(std::make_pair(updated_error.first, std::make_pair(h->edge, updated_error.second)));
-        edge_iterators[h->edge] = it;
-    } else {
-        if(edge_iterators.contains(h->edge)) {
-            pq.erase(edge_iterators[h->edge]);
-            edge_iterators.erase(h->edge);
+void Mesh::quadricErrorSimplification(const SimplifyLimits &limits, ProgressiveMesh *record) {
+    Idx target_faces = std::max<Idx>(limits.faces, std::ceil(limits.face_ratio*numFaces()));
+
+    if(record) record->start(*this);
+
+    // if asked for, the collapses that (nearly) cost nothing go first, all at once
+    if(limits.planar_tolerance > 0) {
+        Eigen::AlignedBox3f box;
+        for(Idx v : vertices()) box.extend(position(v));
+        computeFaceNormals(*this);
+        collapsePlanarVertices(target_faces, limits.vertices, limits.planar_tolerance*box.diagonal().norm(), record);
+    }
+
+    Property<Quadric> vertex_q = computeQuadrics(*this);
+    Property<std::uint8_t> locked = getVertexProperty<std::uint8_t>("locked");
+
+    // collapses never add edges, so the edge slots we have now are all the heap needs
+    IndexedHeap pq(numEdgeSlots());
+    Property<Eigen::Vector3f> targets = addEdgeProperty<Eigen::Vector3f>("qem:target");
+
+    // for each edge in mesh, check if it can be collapsed, and compute Q based on its vertices
+    queueCollapsible(*this, vertex_q, targets, pq, locked);
+
+    // the face count is what the collapses actually removed
+    while(numFaces() > target_faces && numVertices() > limits.vertices) {
+        // take min of pqueue and remove
+        if(pq.empty() || pq.topPriority() > limits.max_error) {
+            break;
+        }
+
+        Idx best_edge = pq.top();
+        float best_error = pq.topPriority();
+        Eigen::Vector3f best_pos = targets[best_edge];
+        pq.pop();
+
+        Idx best_halfedge = edgeHalfedge(best_edge);
+
+        // only edges in the faces around a collapse get rechecked, but a collapse can also give
+        // an edge further away a third shared neighbor, so the queue may hold stale edges
+        if(!canCollapseUnlocked(*this, best_halfedge, locked)) {
+            continue;
+        }
+
+        // also need to delete the other edges being erased
+        pq.remove(edge(next(best_halfedge)));
+        pq.remove(edge(next(next(twin(best_halfedge)))));
+
+        // halfedge vertex is the one we keep, update its Q
+        Idx newVert = vertex(best_halfedge);
+        vertex_q[newVert] += vertex_q[vertex(twin(best_halfedge))];
+
+        Idx recalculate_1 = vertex(next(next(best_halfedge)));
+        Idx recalculate_2 = vertex(next(next(twin(best_halfedge))));
+
+        // collapse that edge
+        if(record) record->beginCollapse(*this, best_halfedge, best_error);
+        collapse(best_halfedge, _free);
+        position(newVert) = best_pos;
+        if(record) record->endCollapse(*this);
+
+        // recompute the Q for all edges touching the new vertex
+        for(Idx h : outgoing(newVert)) {
+            updateEdge(*this, h, pq, targets, vertex_q, locked);
         }
+
+        // check whether certain edges can now be collapsed and update pqueue
+        recheckCanCollapse(*this, newVert, pq, targets, vertex_q, locked);
+        recheckCanCollapse(*this, recalculate_1, pq, targets, vertex_q, locked);
+        recheckCanCollapse(*this, recalculate_2, pq, targets, vertex_q, locked);
     }
+
+    removeVertexProperty("qem:q");
+    removeEdgeProperty("qem:target");
 }
 
-void recheckCanCollapse(Vertex *v, std::multimap<float, std::pair<Edge*, Eigen::Vector3f>> &pq, std::unordered_map<Edge*, std::_Rb_tree_iterator<std::pair<const float, std::pair<Edge*, Eigen::Vector3f>>>> &edge_iterators, std::unordered_map<Vertex*, Eigen::Matrix4f> &vertex_q) {
-    Halfedge *h = v->halfedge;
-    do {
-        updateEdge(h->next, pq, edge_iterators, vertex_q);
-        h = h->twin->next;
+// whether any vertex within one edge of the collapse is already taken by this round
+bool regionTaken(const Mesh &mesh, Idx h, Property<Idx> taken, Idx round) {
+    for(Idx v : {mesh.vertex(h), mesh.vertex(mesh.twin(h))}) {
+        if(taken[v] == round) return true;
+        for(Idx g : mesh.outgoing(v)) {
+            if(taken[mesh.vertex(mesh.twin(g))] == round) return true;
+        }
     }
-    while(h != v->halfedge);
+    return false;
 }
 
-void Mesh::quadricErrorSimplification(int n) {
-    // go back and compute face normals
-    std::unordered_map<Face*, Eigen::Vector3f> normals;
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(!normals.contains(h->face)) {
-            normals[h->face] = computeNormal(h->vertex->pos, h->next->vertex->pos, h->next->next->vertex->pos);
+void takeRegion(const Mesh &mesh, Idx h, Property<Idx> taken, Idx round) {
+    for(Idx v : {mesh.vertex(h), mesh.vertex(mesh.twin(h))}) {
+        taken[v] = round;
+        for(Idx g : mesh.outgoing(v)) {
+            taken[mesh.vertex(mesh.twin(g))] = round;
         }
     }
+}
 
-    // for each vertex in mesh, compute Q
-    std::unordered_map<Vertex*, Eigen::Matrix4f> vertex_q;
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(!vertex_q.contains(h->vertex)) {
-            Halfedge *start = h;
-            Eigen::Matrix4f q = Eigen::Matrix4f::Zero();
-            Eigen::Vector3f p = h->vertex->pos;
-            do {
-                Eigen::Vector3f normal = normals[h->face];
-                float d = -p.dot(normal);
-                Eigen::Matrix4f this_q;
-                this_q << normal[0]*normal[0], normal[0]*normal[1], normal[0]*normal[2], normal[0]*d,
-                          normal[0]*normal[1], normal[1]*normal[1], normal[1]*normal[2], normal[1]*d,
-                          normal[0]*normal[2], normal[1]*normal[2], normal[2]*normal[2], normal[2]*d,
-                          normal[0]*d,         normal[1]*d,         normal[2]*d,         d*d;
-                q += this_q;
-                h = h->twin->next;
+void Mesh::parallelQuadricErrorSimplification(int n, float tolerance) {
+    Idx target_faces = facesAfterRemoving(*this, n);
+    Property<Quadric> vertex_q = computeQuadrics(*this);
+
+    IndexedHeap pq(numEdgeSlots());
+    Property<Eigen::Vector3f> targets = addEdgeProperty<Eigen::Vector3f>("qem:target");
+
+    queueCollapsible(*this, vertex_q, targets, pq);
+
+    // a round's collapses touch disjoint one-rings, so they can run concurrently
+    Property<Idx> taken = addVertexProperty<Idx>("qem:taken", INVALID);
+    Property<Idx> dirty = addEdgeProperty<Idx>("qem:dirty", INVALID);
+    std::vector<Idx> batch;
+    std::vector<std::pair<Idx, float>> skipped;
+    std::vector<Idx> recalculate;
+    std::vector<Idx> update;
+    std::vector<std::uint8_t> collapsible;
+    std::vector<Idx> requeue;
+    std::vector<float> costs;
+    std::vector<FreeLists> freed(omp_get_max_threads());
+
+    for(Idx round = 0; numFaces() > target_faces && !pq.empty(); round++) {
+        // take the cheapest edges, as long as they cost within the tolerance of the cheapest one
+        float limit = pq.topPriority() + tolerance*std::abs(pq.topPriority());
+        batch.clear();
+        skipped.clear();
+        // each collapse takes two faces with it
+        Idx budget = numFaces() - target_faces;
+        while(budget > 0 && !pq.empty() && pq.topPriority() <= limit) {
+            Idx e = pq.top();
+            float cost = pq.topPriority();
+            pq.pop();
+
+            Idx h = edgeHalfedge(e);
+            if(!canCollapse(h)) {
+                // stale, see quadricErrorSimplification
+                continue;
+            }
+            if(regionTaken(*this, h, taken, round)) {
+                // left for a later round
+                skipped.push_back(std::make_pair(e, cost));
+                continue;
             }
-            while(h != start);
-            vertex_q[start->vertex] = q;
+            takeRegion(*this, h, taken, round);
+            batch.push_back(e);
+            budget -= std::min<Idx>(budget, 2);
+        }
+        for(auto &pair : skipped) {
+            pq.update(pair.first, pair.second);
+        }
+
+        // the vertices whose surroundings change, as in the serial version
+        recalculate.clear();
+        for(Idx e : batch) {
+            Idx h = edgeHalfedge(e);
+            pq.remove(edge(next(h)));
+            pq.remove(edge(next(next(twin(h)))));
+            recalculate.push_back(vertex(h));
+            recalculate.push_back(vertex(next(next(h))));
+            recalculate.push_back(vertex(next(next(twin(h)))));
+        }
+
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(Idx i = 0; i < batch.size(); i++) {
+            Idx h = edgeHalfedge(batch[i]);
+            Idx newVert = vertex(h);
+            vertex_q[newVert] += vertex_q[vertex(twin(h))];
+            Eigen::Vector3f best_pos = targets[batch[i]];
+            collapse(h, freed[omp_get_thread_num()]);
+            position(newVert) = best_pos;
+        }
+        for(FreeLists &lists : freed) {
+            _free.vertices.insert(_free.vertices.end(), lists.vertices.begin(), lists.vertices.end());
+            _free.edges.insert(_free.edges.end(), lists.edges.begin(), lists.edges.end());
+            _free.faces.insert(_free.faces.end(), lists.faces.begin(), lists.faces.end());
+            _free.halfedges.insert(_free.halfedges.end(), lists.halfedges.begin(), lists.halfedges.end());
+            lists.vertices.clear();
+            lists.edges.clear();
+            lists.faces.clear();
+            lists.halfedges.clear();
+        }
+
+        // the edges around and across the changed vertices, each once
+        update.clear();
+        for(Idx i = 0; i < recalculate.size(); i++) {
+            Idx v = recalculate[i];
+            for(Idx h : outgoing(v)) {
+                for(Idx e : {edge(h), edge(next(h))}) {
+                    if(dirty[e] == round) continue;
+                    dirty[e] = round;
+                    update.push_back(e);
+                }
+            }
+        }
+
+        collapsible.resize(update.size());
+        #pragma omp parallel for schedule(static)
+        for(Idx i = 0; i < update.size(); i++) {
+            collapsible[i] = canCollapse(edgeHalfedge(update[i]));
+        }
+        requeue.clear();
+        for(Idx i = 0; i < update.size(); i++) {
+            if(collapsible[i]) requeue.push_back(update[i]);
+            else pq.remove(update[i]);
+        }
+
+        collapseCosts(*this, requeue, vertex_q, costs, targets);
+        for(Idx i = 0; i < requeue.size(); i++) {
+            pq.update(requeue[i], costs[i]);
         }
     }
 
-    std::multimap<float, std::pair<Edge*, Eigen::Vector3f>> pq;
-    std::unordered_set<Edge*> seen;
-    std::unordered_map<Edge*, std::_Rb_tree_iterator<std::pair<const float, std::pair<Edge*, Eigen::Vector3f>>>> edge_iterators; // WOW templates
+    removeVertexProperty("qem:q");
+    removeVertexProperty("qem:taken");
+    removeEdgeProperty("qem:target");
+    removeEdgeProperty("qem:dirty");
+}
 
-    // for each edge in mesh, check if it can be collapsed, and compute Q based on its vertices
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
+void Mesh::randomQuadricErrorSimplification(int n, int k) {
+    assert(k > 0);
+    Idx target_faces = facesAfterRemoving(*this, n);
+    Property<Quadric> vertex_q = computeQuadrics(*this);
+
+    // edges to sample from. ones found deleted or not collapsible are dropped as we go, and the latter come
+    // back once a collapse changes the neighborhood they depend on, so an empty list means nothing is left
+    std::vector<Idx> candidates;
+    std::vector<std::uint8_t> listed(numEdgeSlots(), false);
+    candidates.reserve(numEdges());
+    for(Idx e : edges()) {
+        candidates.push_back(e);
+        listed[e] = true;
+    }
+    auto relist = [&](Idx e) {
+        if(listed[e]) return;
+        listed[e] = true;
+        candidates.push_back(e);
+    };
+
+    std::mt19937 rng(0);
+    while(numFaces() > target_faces && !candidates.empty()) {
+        // the cheapest of k random collapsible edges
+        Idx best_halfedge = INVALID;
+        std::pair<float, Eigen::Vector3f> best(std::numeric_limits<float>::infinity(), Eigen::Vector3f::Zero());
+        for(int i = 0; i < k && !candidates.empty();) {
+            Idx c = std::uniform_int_distribution<Idx>(0, candidates.size()-1)(rng);
+            Idx e = candidates[c];
+            if(edgeDeleted(e) || !canCollapse(edgeHalfedge(e))) {
+                listed[e] = false;
+                candidates[c] = candidates.back();
+                candidates.pop_back();
+                continue;
+            }
+            i++;
+
+            Idx h = edgeHalfedge(e);
+            auto cost = collapseCost(*this, h, vertex_q);
+            if(best_halfedge == INVALID || cost.first < best.first) {
+                best_halfedge = h;
+                best = cost;
+            }
+        }
+        if(best_halfedge == INVALID) break;
 
-        if(!seen.contains(h->edge) && canCollapse(h)) {
-            std::pair<float, Eigen::Vector3f> optimize_results = optimal_position(vertex_q[h->vertex]+vertex_q[h->twin->vertex], h->vertex->pos, h->twin->vertex->pos);
-            auto it = pq.insert(std::make_pair(optimize_results.first, std::make_pair(h->edge, optimize_results.second)));
-            edge_iterators[h->edge] = it;
+        // halfedge vertex is the one we keep
+        Idx newVert = vertex(best_halfedge);
+        vertex_q[newVert] += vertex_q[vertex(twin(best_halfedge))];
+        collapse(best_halfedge, _free);
+        position(newVert) = best.second;
+
+        // the link condition of an edge looks at its ends' neighbors, which changed for every edge
+        // touching the new vertex or one of its neighbors
+        for(Idx h : outgoing(newVert)) {
+            relist(edge(h));
+            for(Idx g : outgoing(vertex(twin(h)))) relist(edge(g));
         }
-        seen.insert(h->edge);
     }
 
-    for(; n > 0; n-=2) {
-        // take min of pqueue and remove
-        auto best_edge_entry = pq.begin();
-        if(pq.begin() == pq.end()) {
-            return;
+    removeVertexProperty("qem:q");
+}
+
+// Lindstrom-Turk style cost from the faces around the edge as they are now, with no history:
+// the point that keeps the enclosed volume, and the summed squared volumes it sweeps out
+std::pair<float, Eigen::Vector3f> memorylessCost(const Mesh &mesh, Idx h) {
+    Idx a = mesh.vertex(h);
+    Idx b = mesh.vertex(mesh.twin(h));
+
+    // area weighted planes, so q(x) is the squared volume of the tetrahedron x makes with each face
+    Quadric q;
+    Eigen::Vector3d volume_normal = Eigen::Vector3d::Zero();
+    double volume_offset = 0;
+    auto addFace = [&](Idx g) {
+        Eigen::Vector3d p0 = mesh.position(mesh.vertex(g)).cast<double>();
+        Eigen::Vector3d p1 = mesh.position(mesh.vertex(mesh.next(g))).cast<double>();
+        Eigen::Vector3d p2 = mesh.position(mesh.vertex(mesh.next(mesh.next(g)))).cast<double>();
+        Eigen::Vector3d n = (p1-p0).cross(p2-p0);
+        q += Quadric::plane(n, -n.dot(p0));
+        volume_normal += n;
+        volume_offset += n.dot(p0);
+    };
+    for(Idx g : mesh.outgoing(a)) {
+        addFace(g);
+    }
+    // the two faces on the edge were already counted from a
+    for(Idx g : mesh.outgoing(b)) {
+        if(g != mesh.twin(h) && g != mesh.next(h)) addFace(g);
+    }
+
+    // minimize q subject to volume_normal . x = volume_offset (no change in volume), with the
+    // constraint row scaled to match A so the pivots are comparable
+    double scale = std::sqrt(q.A().trace()) / volume_normal.norm();
+    if(std::isfinite(scale) && scale > 0) {
+        Eigen::Matrix4d kkt;
+        kkt.topLeftCorner<3,3>() = q.A();
+        kkt.topRightCorner<3,1>() = scale*volume_normal;
+        kkt.bottomLeftCorner<1,3>() = scale*volume_normal.transpose();
+        kkt(3,3) = 0;
+        Eigen::Vector4d rhs;
+        rhs << -q.b(), scale*volume_offset;
+
+        Eigen::FullPivLU<Eigen::Matrix4d> lu(kkt);
+        lu.setThreshold(1e-6);
+        if(lu.isInvertible()) {
+            Eigen::Vector3d x = lu.solve(rhs).head<3>();
+            return std::make_pair(q(x), x.cast<float>());
         }
+    }
 
-        Edge *best_edge = best_edge_entry->second.first;
-        Eigen::Vector3f best_pos = best_edge_entry->second.second;
+    // flat around the edge, so any point of the plane keeps the volume
+    return optimal_position(q, mesh.position(a), mesh.position(b));
+}
 
-        edge_iterators.erase(best_edge);
-        pq.erase(best_edge_entry);
+void updateMemoryless(const Mesh &mesh, Idx h, IndexedHeap &pq, Property<Eigen::Vector3f> targets) {
+    Idx e = mesh.edge(h);
+    if(mesh.canCollapse(h)) {
+        auto updated_error = memorylessCost(mesh, h);
+        targets[e] = updated_error.second;
+        pq.update(e, updated_error.first);
+    } else {
+        pq.remove(e);
+    }
+}
 
-        // also need to delete the other edges being erased
-        Edge *erased_1 = best_edge->halfedge->next->edge;
-        Edge *erased_2 = best_edge->halfedge->twin->next->next->edge;
+void Mesh::memorylessSimplification(const SimplifyLimits &limits) {
+    Idx target_faces = std::max<Idx>(limits.faces, std::ceil(limits.face_ratio*numFaces()));
+
+    IndexedHeap pq(numEdgeSlots());
+    Property<Eigen::Vector3f> targets = addEdgeProperty<Eigen::Vector3f>("lt:target");
 
-        if(edge_iterators.contains(erased_1)) {
-            pq.erase(edge_iterators[erased_1]);
-            edge_iterators.erase(erased_1);
+    pq.reserve(numEdges());
+    for(Idx e : edges()) {
+        Idx h = edgeHalfedge(e);
+        if(canCollapse(h)) {
+            auto cost = memorylessCost(*this, h);
+            targets[e] = cost.second;
+            pq.append(e, cost.first);
         }
+    }
+    pq.heapify();
 
-        if(edge_iterators.contains(erased_2)) {
-            pq.erase(edge_iterators[erased_2]);
-            edge_iterators.erase(erased_2);
+    while(numFaces() > target_faces && numVertices() > limits.vertices) {
+        if(pq.empty() || pq.topPriority() > limits.max_error) {
+            break;
         }
 
-        // halfedge vertex is the one we keep, update its Q
-        Vertex *newVert = best_edge->halfedge->vertex;
-        vertex_q[newVert] = vertex_q[newVert] + vertex_q[best_edge->halfedge->twin->vertex];
-        Vertex *deletedVert = best_edge->halfedge->twin->vertex;
-        vertex_q.erase(deletedVert);
+        Idx best_edge = pq.top();
+        Eigen::Vector3f best_pos = targets[best_edge];
+        pq.pop();
 
-        Vertex *recalculate_1 = best_edge->halfedge->next->next->vertex;
-        Vertex *recalculate_2 = best_edge->halfedge->twin->next->next->vertex;
+        Idx best_halfedge = edgeHalfedge(best_edge);
+        if(!canCollapse(best_halfedge)) {
+            // stale, see quadricErrorSimplification
+            continue;
+        }
 
-        // collapse that edge
-        bool collapse_check = edgeCollapse(best_edge->halfedge);
-        assert(collapse_check);
-        newVert->pos = best_pos;
+        pq.remove(edge(next(best_halfedge)));
+        pq.remove(edge(next(next(twin(best_halfedge)))));
 
-        // recompute the Q for all edges touching the new vertex
-        Halfedge *h = newVert->halfedge;
-        do {
-            updateEdge(h, pq, edge_iterators, vertex_q);
-            h = h->twin->next;
+        Idx newVert = vertex(best_halfedge);
+        Idx recalculate_1 = vertex(next(next(best_halfedge)));
+        Idx recalculate_2 = vertex(next(next(twin(best_halfedge))));
+
+        collapse(best_halfedge, _free);
+        position(newVert) = best_pos;
+
+        // the faces around the new vertex changed, and with them the cost of every edge touching them
+        for(Idx h : outgoing(newVert)) {
+            for(Idx g : outgoing(vertex(twin(h)))) {
+                updateMemoryless(*this, g, pq, targets);
+            }
         }
-        while(h != newVert->halfedge);
 
-        // check whether certain edges can now be collapsed and update pqueue
-        recheckCanCollapse(newVert, pq, edge_iterators, vertex_q);
-        recheckCanCollapse(recalculate_1, pq, edge_iterators, vertex_q);
-        recheckCanCollapse(recalculate_2, pq, edge_iterators, vertex_q);
+        // and the opposite vertices lost an edge, which can change which edges around them may collapse
+        for(Idx v : {recalculate_1, recalculate_2}) {
+            for(Idx h : outgoing(v)) {
+                updateMemoryless(*this, next(h), pq, targets);
+            }
+        }
     }
 
+    removeEdgeProperty("lt:target");
 }
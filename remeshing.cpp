@@ -1,5 +1,4 @@
 #include "mesh.h"
-#include <unordered_set>
 #include <iostream>
 
 Eigen::Vector3f triangleNormal(Eigen::Vector3f a, Eigen::Vector3f b, Eigen::Vector3f c) {
@@ -39,122 +38,109 @@ float region_area(Eigen::Vector3f a, Eigen::Vector3f b, Eigen::Vector3f c) {
     return v_area;
 }
 
-float area(Vertex * v) {
+float area(const Mesh &mesh, Idx v) {
     float a = 0;
-    Halfedge *h = v->halfedge;
-    do {
-        a += region_area(h->vertex->pos, h->next->vertex->pos, h->next->next->vertex->pos);
-        h = h->twin->next;
+    for(Idx h : mesh.outgoing(v)) {
+        a += region_area(mesh.position(mesh.vertex(h)), mesh.position(mesh.vertex(mesh.next(h))), mesh.position(mesh.vertex(mesh.next(mesh.next(h)))));
     }
-    while(h != v->halfedge);
 
     return a;
 }
 
 void Mesh::remesh_iteration(float damping) {
-    // unordered map of edge to length
-    std::unordered_map<Edge*, float> lengths;
+    // length of each edge
+    Property<float> lengths = addEdgeProperty<float>("remesh:length");
     float avg_length = 0;
     int n_edges = 0;
 
     // for each edge
     // compute length of edge
     // compute average
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(!lengths.contains(h->edge)) {
-            lengths[h->edge] = (h->vertex->pos - h->twin->vertex->pos).norm();
-            avg_length += lengths[h->edge];
-            n_edges++;
-        }
+    for(Idx e : edges()) {
+        Idx h = edgeHalfedge(e);
+        lengths[e] = (position(vertex(h)) - position(vertex(twin(h)))).norm();
+        avg_length += lengths[e];
+        n_edges++;
     }
 
     avg_length /= n_edges;
 
-    std::unordered_set<Edge*> deleted;
-
-    for(auto &pair : lengths) {
-        Edge *e = pair.first;
-        if(!deleted.contains(e)) {
-            if(pair.second > (4.f/3)*avg_length) {
-                edgeSplit(e->halfedge);
-            } else if(pair.second < (4.f/5)*avg_length) {
-                /*if(canCollapse(e->halfedge)) {
-                    deleted.insert(e->halfedge->next->edge);
-                    deleted.insert(e->halfedge->twin->next->next->edge);
-                    deleted.insert(e);
-                    edgeCollapse(e->halfedge);
-                }*/
-            }
+    // each split adds a vertex, three edges and two faces
+    Idx n_splits = 0;
+    for(Idx e : edges()) {
+        if(lengths[e] > (4.f/3)*avg_length) n_splits++;
+    }
+    reserve(numVertices() + n_splits, numEdges() + 3*n_splits, numFaces() + 2*n_splits);
+
+    // edges created by the splits have no length yet, so they are left alone
+    for(Idx e : edges()) {
+        if(lengths[e] > (4.f/3)*avg_length) {
+            edgeSplit(edgeHalfedge(e));
+        } else if(lengths[e] < (4.f/5)*avg_length) {
+            /*if(canCollapse(edgeHalfedge(e))) {
+                edgeCollapse(edgeHalfedge(e));
+            }*/
         }
     }
 
+    removeEdgeProperty("remesh:length");
+
     // for each edge
     // check degrees and flip if flip is better
-    std::unordered_set<Edge*> seen;
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(!seen.contains(h->edge)) {
-            seen.insert(h->edge);
-            int old_a = degree(h->vertex);
-            int old_b = degree(h->twin->vertex);
-            int old_c = degree(h->next->next->vertex);
-            int old_d = degree(h->twin->next->next->vertex);
-            int old_deviation = std::abs(old_a-6) + std::abs(old_b-6) + std::abs(old_c-6) + std::abs(old_d-6);
-
-            int new_a = old_a-1;
-            int new_b = old_b-1;
-            int new_c = old_c+1;
-            int new_d = old_d+1;
-            int new_deviation = std::abs(new_a-6) + std::abs(new_b-6) + std::abs(new_c-6) + std::abs(new_d-6);
-
-            if(new_deviation < old_deviation) {
-                edgeFlip(h);
-            }
+    for(Idx e : edges()) {
+        Idx h = edgeHalfedge(e);
+        int old_a = degree(vertex(h));
+        int old_b = degree(vertex(twin(h)));
+        int old_c = degree(vertex(next(next(h))));
+        int old_d = degree(vertex(next(next(twin(h)))));
+        int old_deviation = std::abs(old_a-6) + std::abs(old_b-6) + std::abs(old_c-6) + std::abs(old_d-6);
+
+        int new_a = old_a-1;
+        int new_b = old_b-1;
+        int new_c = old_c+1;
+        int new_d = old_d+1;
+        int new_deviation = std::abs(new_a-6) + std::abs(new_b-6) + std::abs(new_c-6) + std::abs(new_d-6);
+
+        if(new_deviation < old_deviation) {
+            edgeFlip(h);
         }
     }
 
     // calculate voronoi areas
-    std::unordered_map<Vertex*, float> areas;
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(!areas.contains(h->vertex)) {
-            areas[h->vertex] = area(h->vertex);
-        }
+    Property<float> areas = addVertexProperty<float>("remesh:area");
+    for(Idx v : vertices()) {
+        areas[v] = area(*this, v);
     }
 
     // find new positions
-    std::unordered_map<Vertex*, Eigen::Vector3f> new_positions;
-    std::unordered_map<Vertex*, Eigen::Vector3f> normal_vectors;
-    for(auto &pair : _halfedges) {
-        Halfedge *h = pair.first;
-        if(!new_positions.contains(h->vertex)) {
-            Halfedge *start = h;
-            float factor = 0;
-            Eigen::Vector3f centroid = Eigen::Vector3f(0,0,0);
-            int n_faces = 0;
-            Eigen::Vector3f normal = Eigen::Vector3f(0,0,0);
-            do {
-                factor += areas[h->twin->vertex];
-                centroid += areas[h->twin->vertex] * h->twin->vertex->pos;
-                n_faces++;
-                normal += triangleNormal(h->vertex->pos, h->next->vertex->pos, h->next->next->vertex->pos);
-                h = h->twin->next;
-            }
-            while(h != start);
-            new_positions[h->vertex] = centroid/factor;
-            normal_vectors[h->vertex] = normal/n_faces;
+    Property<Eigen::Vector3f> new_positions = addVertexProperty<Eigen::Vector3f>("remesh:new_position");
+    Property<Eigen::Vector3f> normal_vectors = addVertexProperty<Eigen::Vector3f>("remesh:normal");
+    for(Idx v : vertices()) {
+        float factor = 0;
+        Eigen::Vector3f centroid = Eigen::Vector3f(0,0,0);
+        int n_faces = 0;
+        Eigen::Vector3f normal = Eigen::Vector3f(0,0,0);
+        for(Idx h : outgoing(v)) {
+            factor += areas[vertex(twin(h))];
+            centroid += areas[vertex(twin(h))] * position(vertex(twin(h)));
+            n_faces++;
+            normal += triangleNormal(position(vertex(h)), position(vertex(next(h))), position(vertex(next(next(h)))));
         }
+        new_positions[v] = centroid/factor;
+        normal_vectors[v] = normal/n_faces;
     }
 
     // move towards new position
-    for(auto &pair : new_positions) {
-        Vertex *v = pair.first;
-        Eigen::Vector3f pos = v->pos;
+    for(Idx v : vertices()) {
+        Eigen::Vector3f pos = position(v);
         Eigen::Vector3f n = normal_vectors[v];
-        Eigen::Vector3f new_pos = pair.second;
-        v->pos = pos + damping*(Eigen::Matrix3f::Identity() - n*n.transpose())*(new_pos-pos);
+        Eigen::Vector3f new_pos = new_positions[v];
+        position(v) = pos + damping*(Eigen::Matrix3f::Identity() - n*n.transpose())*(new_pos-pos);
     }
+
+    removeVertexProperty("remesh:area");
+    removeVertexProperty("remesh:new_position");
+    removeVertexProperty("remesh:normal");
 }
 
 void Mesh::remesh(int n, float damping) {
@@ -0,0 +1,124 @@
+#include "mesh.h"
+
+#include <cmath>
+#include <numbers>
+
+using namespace Eigen;
+
+// the weight of the one-ring in Kobbelt's rule for an old vertex of degree n
+static float sqrt3_weight(int n) {
+    return (4 - 2*std::cos(2.f*std::numbers::pi/n)) / 9;
+}
+
+// a √3 step splits each face at its centroid and flips every old edge, which leaves one face per old
+// halfedge h (from a, in face f, whose twin is in face g): a, then g's centroid, then f's. the refined mesh
+// is written straight into new arrays: face f's centroid is vertex V+f, face h has halfedges 3h (a to g's
+// centroid), 3h+1 (the flipped old edge) and 3h+2 (f's centroid back to a), and the new edge from a to f's
+// centroid is E+h. a deleted vertex slot stays deleted
+void Mesh::sqrt3Subdivide() {
+    const Idx n_vertices = numVertexSlots();
+    const Idx n_edges = numEdgeSlots();
+    const Idx n_faces = numFaceSlots();
+    const Idx n_halfedges = numHalfedgeSlots();
+
+    // new positions from the current mesh, which is only read: old vertices are relaxed towards their
+    // one-ring, and each face gets its centroid
+    std::vector<Vector3f> v_pos(n_vertices + n_faces);
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        if(vertexDeleted(v)) continue;
+        int n = degree(v);
+        float alpha = sqrt3_weight(n);
+
+        Vector3f sum = Vector3f(0,0,0);
+        for(Idx h : outgoing(v)) {
+            sum += position(vertex(twin(h)));
+        }
+        v_pos[v] = (1-alpha)*position(v) + (alpha/n)*sum;
+    }
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        Idx h = faceHalfedge(f);
+        v_pos[n_vertices + f] = (position(vertex(h)) + position(vertex(next(h))) + position(vertex(next(next(h)))))/3;
+    }
+
+    std::vector<Idx> he_next(3*n_halfedges);
+    std::vector<Idx> he_twin(he_next.size());
+    std::vector<Idx> he_vertex(he_next.size());
+    std::vector<Idx> he_edge(he_next.size());
+    std::vector<Idx> he_face(he_next.size());
+    std::vector<Idx> v_halfedge(n_vertices + n_faces);
+    std::vector<Idx> v_degree(n_vertices + n_faces);
+    std::vector<Idx> e_halfedge(n_edges + n_halfedges);
+    std::vector<Idx> f_halfedge(n_halfedges);
+
+    // old vertices now only connect to the centroids around them, so keep their degree; centroids have
+    // their 3 corners and the 3 neighboring centroids
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        v_halfedge[v] = vertexDeleted(v) ? INVALID : 3*vertexHalfedge(v);
+        v_degree[v] = _v_degree[v];
+    }
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        v_halfedge[n_vertices + f] = 3*faceHalfedge(f) + 2;
+        v_degree[n_vertices + f] = 6;
+    }
+    #pragma omp parallel for
+    for(Idx e = 0; e < n_edges; e++) {
+        e_halfedge[e] = 3*edgeHalfedge(e) + 1;
+    }
+
+    // each halfedge only writes its own face; the twins across the new edges are found through the old
+    // halfedges around a: the one before h in f, and the one after h's twin in g
+    #pragma omp parallel for
+    for(Idx h = 0; h < n_halfedges; h++) {
+        Idx t = twin(h);
+        Idx before = twin(next(next(h)));
+        Idx after = next(t);
+
+        he_vertex[3*h] = vertex(h);
+        he_vertex[3*h+1] = n_vertices + face(t);
+        he_vertex[3*h+2] = n_vertices + face(h);
+
+        he_twin[3*h] = 3*after + 2;
+        he_twin[3*h+1] = 3*t + 1;
+        he_twin[3*h+2] = 3*before;
+
+        he_edge[3*h] = n_edges + after;
+        he_edge[3*h+1] = edge(h);
+        he_edge[3*h+2] = n_edges + h;
+        e_halfedge[n_edges + h] = 3*h + 2;
+
+        for(Idx i = 0; i < 3; i++) {
+            he_next[3*h + i] = 3*h + (i+1)%3;
+            he_face[3*h + i] = h;
+        }
+        f_halfedge[h] = 3*h;
+    }
+
+    _he_next.swap(he_next);
+    _he_twin.swap(he_twin);
+    _he_vertex.swap(he_vertex);
+    _he_edge.swap(he_edge);
+    _he_face.swap(he_face);
+    _v_halfedge.swap(v_halfedge);
+    _v_pos.swap(v_pos);
+    _v_degree.swap(v_degree);
+    _e_halfedge.swap(e_halfedge);
+    _e_is_new.assign(_e_halfedge.size(), false);
+    _f_halfedge.swap(f_halfedge);
+
+    _vertex_props.resize(numVertexSlots());
+    _edge_props.resize(numEdgeSlots());
+    _face_props.resize(numFaceSlots());
+    _halfedge_props.resize(numHalfedgeSlots());
+}
+
+void Mesh::sqrt3Subdivision(int n) {
+    compact();
+
+    for(int i = 0; i < n; i++) {
+        sqrt3Subdivide();
+    }
+}
@@ -0,0 +1,194 @@
+#include "mesh.h"
+#include "quadric.h"
+#include "parallel_utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+using namespace std;
+
+// a cell's grid coordinates are packed into one key, so each is kept under 2^CELL_BITS
+constexpr int CELL_BITS = 10;
+
+// in the spirit of Lindstrom's out-of-core clustering: every pass is over the vertex or face arrays
+// (or the much smaller cell array), and the cells are found by radix sorting the vertices' keys
+void Mesh::clusterSimplification(int resolution) {
+    if(_has_halfedges) {
+        exportHalfedges();
+        releaseHalfedges();
+    }
+
+    const Idx n_vertices = _vertices.size();
+    const Idx n_faces = _faces.size();
+    if(n_vertices == 0) return;
+    resolution = std::clamp(resolution, 1, 1 << CELL_BITS);
+
+    const int n_threads = omp_get_max_threads();
+
+    // bounding box, per thread and then combined
+    vector<AlignedBox3f> boxes(n_threads);
+    #pragma omp parallel num_threads(n_threads)
+    {
+        AlignedBox3f &box = boxes[omp_get_thread_num()];
+        #pragma omp for
+        for(Idx v = 0; v < n_vertices; v++) box.extend(_vertices[v]);
+    }
+    AlignedBox3f box;
+    for(const AlignedBox3f &b : boxes) box.extend(b);
+
+    // cubic cells, `resolution` of them along the longest side
+    float cell_size = box.sizes().maxCoeff() / resolution;
+    if(!(cell_size > 0)) cell_size = 1;
+    auto cellOf = [&](const Vector3f &p) -> Vector3i {
+        Vector3i cell = ((p - box.min()) / cell_size).cast<int>();
+        return cell.cwiseMax(0).cwiseMin(resolution-1);
+    };
+    auto cellKey = [](const Vector3i &cell) {
+        return uint64_t(cell[0]) | (uint64_t(cell[1]) << CELL_BITS) | (uint64_t(cell[2]) << 2*CELL_BITS);
+    };
+
+    // sorting the vertices by cell puts each cell's vertices next to each other
+    vector<uint64_t> keys(n_vertices);
+    vector<Idx> sorted(n_vertices);
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        keys[v] = cellKey(cellOf(_vertices[v]));
+        sorted[v] = v;
+    }
+    radixSort(keys, sorted, 3*CELL_BITS);
+
+    // the occupied cells are the clusters, numbered by where their runs start
+    vector<Idx> run_index;
+    Idx n_clusters = compactIndices(n_vertices, [&](Idx i) {return i == 0 || keys[i] != keys[i-1];}, run_index);
+    vector<Idx> run_begin(n_clusters+1, n_vertices);
+    #pragma omp parallel for
+    for(Idx i = 0; i < n_vertices; i++) {
+        if(run_index[i] != INVALID) run_begin[run_index[i]] = i;
+    }
+
+    vector<Idx> cluster(n_vertices);
+    vector<Vector3f> mean(n_clusters);
+    #pragma omp parallel for
+    for(Idx c = 0; c < n_clusters; c++) {
+        Vector3f sum = Vector3f::Zero();
+        for(Idx i = run_begin[c]; i < run_begin[c+1]; i++) {
+            cluster[sorted[i]] = c;
+            sum += _vertices[sorted[i]];
+        }
+        mean[c] = sum / (run_begin[c+1] - run_begin[c]);
+    }
+
+    // each face's plane goes into the quadric of each of its corners' clusters. rather than threads summing
+    // into copies of every cluster's quadric, each cluster sums its own vertices' faces, found through a
+    // vertex to face index that is the size of the face list
+    vector<Idx> face_begin(n_vertices+1, 0);
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        for(int i = 0; i < 3; i++) {
+            #pragma omp atomic
+            face_begin[_faces[f][i]+1]++;
+        }
+    }
+    for(Idx v = 0; v < n_vertices; v++) face_begin[v+1] += face_begin[v];
+
+    vector<Idx> vertex_faces(3*size_t(n_faces));
+    vector<Idx> face_end(face_begin.begin(), face_begin.end()-1);
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        for(int i = 0; i < 3; i++) {
+            Idx slot;
+            #pragma omp atomic capture
+            slot = face_end[_faces[f][i]]++;
+            vertex_faces[slot] = f;
+        }
+    }
+    vector<Idx>().swap(face_end);
+
+    // the faces are summed in order, so that the result doesn't depend on which thread filled them in
+    #pragma omp parallel for
+    for(Idx v = 0; v < n_vertices; v++) {
+        std::sort(vertex_faces.begin() + face_begin[v], vertex_faces.begin() + face_begin[v+1]);
+    }
+
+    vector<Quadric> cluster_q(n_clusters);
+    vector<float> error(n_clusters);
+    vector<Vector3f> position(n_clusters);
+    #pragma omp parallel for
+    for(Idx c = 0; c < n_clusters; c++) {
+        for(Idx i = run_begin[c]; i < run_begin[c+1]; i++) {
+            Idx v = sorted[i];
+            for(Idx j = face_begin[v]; j < face_begin[v+1]; j++) {
+                const Vector3i &face = _faces[vertex_faces[j]];
+                Vector3d a = _vertices[face[0]].cast<double>();
+                Vector3d b = _vertices[face[1]].cast<double>();
+                Vector3d d = _vertices[face[2]].cast<double>();
+                Vector3d normal = (b-a).cross(d-a).normalized();
+                cluster_q[c] += Quadric::plane(normal, -a.dot(normal));
+            }
+        }
+    }
+    vector<Idx>().swap(face_begin);
+    vector<Idx>().swap(vertex_faces);
+
+    // the quadric's minimum, or the mean where it has none, kept inside the cell
+    const Idx block = 256;
+    #pragma omp parallel for
+    for(Idx start = 0; start < n_clusters; start += block) {
+        Idx n = std::min(block, n_clusters - start);
+        optimal_positions(n, &cluster_q[start], &mean[start], &mean[start], &error[start], &position[start]);
+        for(Idx c = start; c < start + n; c++) {
+            Vector3f cell_min = box.min() + cellOf(mean[c]).cast<float>() * cell_size;
+            position[c] = position[c].cwiseMax(cell_min).cwiseMin(cell_min + Vector3f::Constant(cell_size));
+        }
+    }
+
+    // faces with corners in three different clusters survive, rotated to start at their smallest
+    // cluster so that duplicates (with the same orientation) compare equal
+    vector<Vector3i> clustered(n_faces);
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        Vector3i face(cluster[_faces[f][0]], cluster[_faces[f][1]], cluster[_faces[f][2]]);
+        if(face[0] == face[1] || face[1] == face[2] || face[2] == face[0]) {
+            face[0] = -1;
+        } else {
+            int first = face[0] < face[1] ? (face[0] < face[2] ? 0 : 2) : (face[1] < face[2] ? 1 : 2);
+            face = Vector3i(face[first], face[(first+1)%3], face[(first+2)%3]);
+        }
+        clustered[f] = face;
+    }
+
+    vector<Idx> face_index;
+    Idx n_kept = compactIndices(n_faces, [&](Idx f) {return clustered[f][0] >= 0;}, face_index);
+    _faces.resize(n_kept);
+    #pragma omp parallel for
+    for(Idx f = 0; f < n_faces; f++) {
+        if(face_index[f] != INVALID) _faces[face_index[f]] = clustered[f];
+    }
+    vector<Vector3i>().swap(clustered);
+
+    // only as many faces as the output has are sorted here
+    auto less = [](const Vector3i &a, const Vector3i &b) {
+        return std::lexicographical_compare(a.data(), a.data()+3, b.data(), b.data()+3);
+    };
+    std::sort(_faces.begin(), _faces.end(), less);
+    _faces.erase(std::unique(_faces.begin(), _faces.end()), _faces.end());
+
+    // clusters left without faces are dropped
+    vector<uint8_t> used(n_clusters, false);
+    for(const Vector3i &face : _faces) {
+        for(int i = 0; i < 3; i++) used[face[i]] = true;
+    }
+    vector<Idx> vertex_index;
+    Idx n_used = compactIndices(n_clusters, [&](Idx c) {return bool(used[c]);}, vertex_index);
+
+    _vertices.resize(n_used);
+    #pragma omp parallel for
+    for(Idx c = 0; c < n_clusters; c++) {
+        if(vertex_index[c] != INVALID) _vertices[vertex_index[c]] = position[c];
+    }
+    #pragma omp parallel for
+    for(Idx f = 0; f < Idx(_faces.size()); f++) {
+        for(int i = 0; i < 3; i++) _faces[f][i] = vertex_index[_faces[f][i]];
+    }
+}